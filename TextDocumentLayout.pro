@@ -25,15 +25,9 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 SOURCES += \
         main.cpp \
-        mainwindow.cpp \
-    vtextdocumentlayout.cpp \
-    vtextedit.cpp \
-    vlinenumberarea.cpp \
-    vimageresourcemanager2.cpp
+        mainwindow.cpp
 
 HEADERS += \
-        mainwindow.h \
-    vtextdocumentlayout.h \
-    vtextedit.h \
-    vlinenumberarea.h \
-    vimageresourcemanager2.h
+        mainwindow.h
+
+include(vtextedit.pri)
@@ -0,0 +1,26 @@
+#-------------------------------------------------
+#
+# Headless benchmarks of VTextDocumentLayout and VTextEdit.
+#
+# Run offscreen and write machine-readable results, e.g.
+#   ./layoutbenchmark -o results.xml,xml
+#   ./layoutbenchmark -o results.csv,csv
+#
+#-------------------------------------------------
+
+QT       += core gui testlib
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = layoutbenchmark
+TEMPLATE = app
+
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    layoutbenchmark.cpp
+
+include(../vtextedit.pri)
@@ -0,0 +1,394 @@
+#include <QtTest>
+#include <QApplication>
+#include <QTextDocument>
+#include <QTextCursor>
+#include <QTextBlock>
+#include <QPainter>
+#include <QImage>
+#include <QPixmap>
+#include <QScrollBar>
+#include <QStringList>
+
+#include "vtextdocumentlayout.h"
+#include "vtextedit.h"
+#include "vimageresourcemanager2.h"
+#include "vlinenumberarea.h"
+
+
+// One block out of this number of blocks has an image.
+static const int c_imageInterval = 50;
+
+static const int c_viewportWidth = 800;
+
+static const int c_viewportHeight = 600;
+
+static const QString c_imageName = QStringLiteral("image");
+
+static QString generateText(int p_blockCount)
+{
+    QStringList lines;
+    lines.reserve(p_blockCount);
+    for (int i = 0; i < p_blockCount; ++i) {
+        lines << QStringLiteral("%1 The quick brown fox jumps over the lazy dog.").arg(i);
+    }
+
+    return lines.join(QLatin1Char('\n'));
+}
+
+static QVector<VBlockImageInfo2> generateImageInfos(int p_blockCount)
+{
+    QVector<VBlockImageInfo2> infos;
+    for (int i = 0; i < p_blockCount; i += c_imageInterval) {
+        infos.append(VBlockImageInfo2(i, c_imageName));
+    }
+
+    return infos;
+}
+
+// A document laid out by VTextDocumentLayout.
+class LayoutFixture
+{
+public:
+    LayoutFixture(bool p_images)
+    {
+        m_doc.setTextWidth(c_viewportWidth);
+        m_layout = new VTextDocumentLayout(&m_doc, &m_imageMgr);
+        m_layout->setBlockImageEnabled(p_images);
+        m_layout->setImageWidthConstrainted(true);
+        m_doc.setDocumentLayout(m_layout);
+
+        m_images = p_images;
+    }
+
+    void setText(int p_blockCount)
+    {
+        // Set the text first, which would shift the image infos set before.
+        m_doc.setPlainText(generateText(p_blockCount));
+
+        if (m_images) {
+            m_imageMgr.addImage(c_imageName, QPixmap(640, 480));
+            m_layout->relayoutBlocks(m_imageMgr.updateBlockInfos(generateImageInfos(p_blockCount)));
+        }
+    }
+
+    // Y offset of the middle of the document.
+    qreal middle() const
+    {
+        return m_layout->documentSize().height() / 2;
+    }
+
+    VImageResourceManager2 m_imageMgr;
+
+    QTextDocument m_doc;
+
+    VTextDocumentLayout *m_layout;
+
+    bool m_images;
+};
+
+
+class LayoutBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initialLayout_data();
+    void initialLayout();
+
+    void typing_data();
+    void typing();
+
+    void insertNewline_data();
+    void insertNewline();
+
+    void draw_data();
+    void draw();
+
+    void drawSearchMatches_data();
+    void drawSearchMatches();
+
+    void hitTest_data();
+    void hitTest();
+
+    void findBlockByPosition_data();
+    void findBlockByPosition();
+
+    void paintLineNumberArea_data();
+    void paintLineNumberArea();
+
+private:
+    static void addDocumentColumns();
+
+    static void addDocumentRows();
+
+    static void addPositionRows();
+
+    static int positionInDocument(const QTextDocument &p_doc, const QString &p_position);
+};
+
+void LayoutBenchmark::addDocumentColumns()
+{
+    QTest::addColumn<int>("blockCount");
+    QTest::addColumn<bool>("images");
+}
+
+void LayoutBenchmark::addPositionRows()
+{
+    addDocumentColumns();
+    QTest::addColumn<QString>("position");
+
+    const int counts[] = { 10000, 100000, 1000000 };
+    const char *positions[] = { "top", "middle", "bottom" };
+    for (int cnt : counts) {
+        for (int img = 0; img < 2; ++img) {
+            for (const char *pos : positions) {
+                QString name = QStringLiteral("%1-%2-%3").arg(cnt)
+                                                         .arg(QString::fromLatin1(img ? "images" : "text"))
+                                                         .arg(QString::fromLatin1(pos));
+                QTest::newRow(qPrintable(name)) << cnt << (img == 1) << QString::fromLatin1(pos);
+            }
+        }
+    }
+}
+
+int LayoutBenchmark::positionInDocument(const QTextDocument &p_doc, const QString &p_position)
+{
+    int blockNumber = 0;
+    if (p_position == "middle") {
+        blockNumber = p_doc.blockCount() / 2;
+    } else if (p_position == "bottom") {
+        blockNumber = p_doc.blockCount() - 1;
+    }
+
+    return p_doc.findBlockByNumber(blockNumber).position();
+}
+
+void LayoutBenchmark::addDocumentRows()
+{
+    addDocumentColumns();
+
+    const int counts[] = { 10000, 100000, 1000000 };
+    for (int cnt : counts) {
+        QTest::newRow(qPrintable(QStringLiteral("%1-text").arg(cnt))) << cnt << false;
+        QTest::newRow(qPrintable(QStringLiteral("%1-images").arg(cnt))) << cnt << true;
+    }
+}
+
+void LayoutBenchmark::initialLayout_data()
+{
+    addDocumentRows();
+}
+
+void LayoutBenchmark::initialLayout()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+
+    LayoutFixture fixture(images);
+    QBENCHMARK_ONCE {
+        fixture.setText(blockCount);
+    }
+
+    QCOMPARE(fixture.m_doc.blockCount(), blockCount);
+}
+
+void LayoutBenchmark::typing_data()
+{
+    addPositionRows();
+}
+
+void LayoutBenchmark::typing()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+    QFETCH(QString, position);
+
+    LayoutFixture fixture(images);
+    fixture.setText(blockCount);
+
+    QTextCursor cursor(&fixture.m_doc);
+    cursor.setPosition(positionInDocument(fixture.m_doc, position));
+    QBENCHMARK {
+        cursor.insertText(QStringLiteral("a"));
+    }
+}
+
+void LayoutBenchmark::insertNewline_data()
+{
+    addPositionRows();
+}
+
+void LayoutBenchmark::insertNewline()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+    QFETCH(QString, position);
+
+    LayoutFixture fixture(images);
+    fixture.setText(blockCount);
+
+    QTextCursor cursor(&fixture.m_doc);
+    cursor.setPosition(positionInDocument(fixture.m_doc, position));
+    QBENCHMARK {
+        cursor.insertBlock();
+    }
+}
+
+void LayoutBenchmark::draw_data()
+{
+    addDocumentRows();
+}
+
+void LayoutBenchmark::draw()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+
+    LayoutFixture fixture(images);
+    fixture.setText(blockCount);
+
+    QImage image(c_viewportWidth, c_viewportHeight, QImage::Format_ARGB32_Premultiplied);
+    QPainter painter(&image);
+    qreal top = fixture.middle();
+    painter.translate(0, -top);
+
+    QAbstractTextDocumentLayout::PaintContext context;
+    context.clip = QRectF(0, top, c_viewportWidth, c_viewportHeight);
+    QBENCHMARK {
+        fixture.m_layout->draw(&painter, context);
+    }
+}
+
+void LayoutBenchmark::drawSearchMatches_data()
+{
+    addDocumentRows();
+}
+
+// Draw with one highlighted match in each block, like highlighting all the
+// matches of a search.
+void LayoutBenchmark::drawSearchMatches()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+
+    LayoutFixture fixture(images);
+    fixture.setText(blockCount);
+
+    QImage image(c_viewportWidth, c_viewportHeight, QImage::Format_ARGB32_Premultiplied);
+    QPainter painter(&image);
+    qreal top = fixture.middle();
+    painter.translate(0, -top);
+
+    QAbstractTextDocumentLayout::PaintContext context;
+    context.clip = QRectF(0, top, c_viewportWidth, c_viewportHeight);
+    context.selections.reserve(blockCount);
+
+    const QString word = QStringLiteral("fox");
+    QAbstractTextDocumentLayout::Selection sel;
+    sel.format.setBackground(Qt::yellow);
+    QTextBlock block = fixture.m_doc.begin();
+    while (block.isValid()) {
+        int pos = block.position() + block.text().indexOf(word);
+        sel.cursor = QTextCursor(&fixture.m_doc);
+        sel.cursor.setPosition(pos);
+        sel.cursor.setPosition(pos + word.size(), QTextCursor::KeepAnchor);
+        context.selections.append(sel);
+        block = block.next();
+    }
+
+    QBENCHMARK {
+        fixture.m_layout->draw(&painter, context);
+    }
+}
+
+void LayoutBenchmark::hitTest_data()
+{
+    addDocumentRows();
+}
+
+void LayoutBenchmark::hitTest()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+
+    LayoutFixture fixture(images);
+    fixture.setText(blockCount);
+
+    QPointF point(c_viewportWidth / 2, fixture.middle());
+    int pos = -1;
+    QBENCHMARK {
+        pos = fixture.m_layout->hitTest(point, Qt::FuzzyHit);
+    }
+
+    QVERIFY(pos > -1);
+}
+
+void LayoutBenchmark::findBlockByPosition_data()
+{
+    addDocumentRows();
+}
+
+void LayoutBenchmark::findBlockByPosition()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+
+    LayoutFixture fixture(images);
+    fixture.setText(blockCount);
+
+    QPointF point(0, fixture.middle());
+    int blockNumber = -1;
+    QBENCHMARK {
+        blockNumber = fixture.m_layout->findBlockByPosition(point);
+    }
+
+    QVERIFY(blockNumber > -1);
+}
+
+void LayoutBenchmark::paintLineNumberArea_data()
+{
+    addDocumentRows();
+}
+
+void LayoutBenchmark::paintLineNumberArea()
+{
+    QFETCH(int, blockCount);
+    QFETCH(bool, images);
+
+    VTextEdit edit;
+    edit.resize(c_viewportWidth, c_viewportHeight);
+    edit.setLineNumberType(LineNumberType::Absolute);
+    edit.setBlockImageEnabled(images);
+    edit.setPlainText(generateText(blockCount));
+    if (images) {
+        edit.addImage(c_imageName, QPixmap(640, 480));
+        edit.updateBlockImages(generateImageInfos(blockCount));
+    }
+    edit.show();
+    QVERIFY(QTest::qWaitForWindowExposed(&edit));
+
+    QScrollBar *sb = edit.verticalScrollBar();
+    sb->setValue(sb->maximum() / 2);
+
+    VLineNumberArea *area = edit.findChild<VLineNumberArea *>();
+    QVERIFY(area);
+    QBENCHMARK {
+        // Otherwise the cached rows are reused and nothing is drawn.
+        area->invalidateCache();
+        area->repaint();
+    }
+}
+
+int main(int p_argc, char *p_argv[])
+{
+    // Run headless unless told otherwise.
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    QApplication app(p_argc, p_argv);
+    LayoutBenchmark bench;
+    return QTest::qExec(&bench, p_argc, p_argv);
+}
+
+#include "layoutbenchmark.moc"
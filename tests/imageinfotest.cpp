@@ -0,0 +1,164 @@
+#include <QtTest>
+#include <QApplication>
+#include <QTextDocument>
+#include <QTextCursor>
+#include <QTextBlock>
+#include <QPixmap>
+#include <QStringList>
+
+#include "vtextdocumentlayout.h"
+#include "vimageresourcemanager2.h"
+#include "vtextedit.h"
+
+
+static const QString c_imageName = QStringLiteral("image");
+
+// A document of @p_blockCount blocks laid out by VTextDocumentLayout, with
+// images on the blocks @p_imageBlocks.
+class ImageInfoFixture
+{
+public:
+    ImageInfoFixture(int p_blockCount, const QVector<int> &p_imageBlocks)
+    {
+        m_doc.setTextWidth(800);
+        m_layout = new VTextDocumentLayout(&m_doc, &m_imageMgr);
+        m_layout->setBlockImageEnabled(true);
+        m_doc.setDocumentLayout(m_layout);
+
+        QStringList lines;
+        for (int i = 0; i < p_blockCount; ++i) {
+            lines << QStringLiteral("line %1").arg(i);
+        }
+
+        m_doc.setPlainText(lines.join(QLatin1Char('\n')));
+
+        m_imageMgr.addImage(c_imageName, QPixmap(64, 48));
+        QVector<VBlockImageInfo2> infos;
+        for (auto const &num : p_imageBlocks) {
+            infos.append(VBlockImageInfo2(num, c_imageName));
+        }
+
+        m_layout->relayoutBlocks(m_imageMgr.updateBlockInfos(infos));
+    }
+
+    // Numbers of the blocks with image.
+    QVector<int> imageBlocks() const
+    {
+        QVector<int> blocks;
+        for (int i = 0; i < m_doc.blockCount(); ++i) {
+            if (m_imageMgr.findImageInfoByBlock(i)) {
+                blocks.append(i);
+            }
+        }
+
+        return blocks;
+    }
+
+    QTextCursor cursorAt(int p_blockNumber, int p_column = 0)
+    {
+        QTextCursor cursor(&m_doc);
+        cursor.setPosition(m_doc.findBlockByNumber(p_blockNumber).position() + p_column);
+        return cursor;
+    }
+
+    VImageResourceManager2 m_imageMgr;
+
+    QTextDocument m_doc;
+
+    VTextDocumentLayout *m_layout;
+};
+
+
+class ImageInfoTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void newlineAtStartOfImageBlock();
+
+    void newlineAtEndOfImageBlock();
+
+    void textAtStartOfImageBlock();
+
+    void removeBlockAboveImage();
+
+    void equalLengthEditAcrossBlocks();
+
+    void resizeKeepsImages();
+
+    void defaultFontChangeKeepsImages();
+};
+
+void ImageInfoTest::newlineAtStartOfImageBlock()
+{
+    ImageInfoFixture fixture(5, QVector<int>() << 2 << 4);
+    fixture.cursorAt(2).insertBlock();
+    QCOMPARE(fixture.imageBlocks(), QVector<int>() << 3 << 5);
+}
+
+void ImageInfoTest::newlineAtEndOfImageBlock()
+{
+    ImageInfoFixture fixture(5, QVector<int>() << 2 << 4);
+    QTextCursor cursor = fixture.cursorAt(2);
+    cursor.movePosition(QTextCursor::EndOfBlock);
+    cursor.insertBlock();
+    QCOMPARE(fixture.imageBlocks(), QVector<int>() << 2 << 5);
+}
+
+void ImageInfoTest::textAtStartOfImageBlock()
+{
+    ImageInfoFixture fixture(5, QVector<int>() << 2 << 4);
+    fixture.cursorAt(2).insertText(QStringLiteral("new\nlines\n"));
+    QCOMPARE(fixture.imageBlocks(), QVector<int>() << 4 << 6);
+}
+
+void ImageInfoTest::removeBlockAboveImage()
+{
+    ImageInfoFixture fixture(5, QVector<int>() << 2 << 4);
+    QTextCursor cursor = fixture.cursorAt(0);
+    cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor);
+    cursor.removeSelectedText();
+    QCOMPARE(fixture.imageBlocks(), QVector<int>() << 1 << 3);
+}
+
+void ImageInfoTest::equalLengthEditAcrossBlocks()
+{
+    // Replace "ne 1\nli" with "xx\nxxxx", which keeps the length and the block
+    // count while replacing block 2.
+    ImageInfoFixture fixture(5, QVector<int>() << 2 << 4);
+    QTextCursor cursor = fixture.cursorAt(1, 2);
+    cursor.setPosition(fixture.cursorAt(2, 2).position(), QTextCursor::KeepAnchor);
+    cursor.insertText(QStringLiteral("xx\nxxxx"));
+    QCOMPARE(fixture.m_doc.blockCount(), 5);
+    QCOMPARE(fixture.imageBlocks(), QVector<int>() << 4);
+}
+
+void ImageInfoTest::resizeKeepsImages()
+{
+    ImageInfoFixture fixture(5, QVector<int>() << 0 << 2 << 4);
+    fixture.m_doc.setTextWidth(400);
+    QCOMPARE(fixture.imageBlocks(), QVector<int>() << 0 << 2 << 4);
+}
+
+void ImageInfoTest::defaultFontChangeKeepsImages()
+{
+    ImageInfoFixture fixture(5, QVector<int>() << 0 << 2 << 4);
+    QFont font = fixture.m_doc.defaultFont();
+    font.setPointSize(font.pointSize() + 4);
+    fixture.m_doc.setDefaultFont(font);
+    QCOMPARE(fixture.imageBlocks(), QVector<int>() << 0 << 2 << 4);
+}
+
+int main(int p_argc, char *p_argv[])
+{
+    // Run headless unless told otherwise.
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    QApplication app(p_argc, p_argv);
+    ImageInfoTest test;
+    return QTest::qExec(&test, p_argc, p_argv);
+}
+
+#include "imageinfotest.moc"
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Headless tests of VTextDocumentLayout and VTextEdit.
+#
+#-------------------------------------------------
+
+QT       += core gui testlib
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = imageinfotest
+TEMPLATE = app
+
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    imageinfotest.cpp
+
+include(../vtextedit.pri)
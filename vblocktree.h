@@ -0,0 +1,505 @@
+#ifndef VBLOCKTREE_H
+#define VBLOCKTREE_H
+
+#include <QVector>
+#include <QtGlobal>
+
+
+// A sequence of entries, each with a non-negative integer value and a payload
+// of type T, kept in an implicit-key treap. Entries are addressed by index.
+// Insertion and removal of entries, lookup by index, point update, prefix sum
+// and search by prefix sum cost O(log n) in expectation, plus O(k) for k
+// entries inserted or removed at once.
+template <typename T>
+class VBlockTree
+{
+public:
+    VBlockTree();
+
+    int size() const;
+
+    bool isEmpty() const;
+
+    void clear();
+
+    // Resize to @p_size entries. New entries have value 0.
+    void resize(int p_size);
+
+    // Insert @p_count entries of value 0 and default payload at @p_idx.
+    void insert(int p_idx, int p_count);
+
+    // Remove @p_count entries from @p_idx.
+    void remove(int p_idx, int p_count);
+
+    // Payload of entry @p_idx.
+    // References are invalidated by insert() and resize().
+    T &operator[](int p_idx);
+
+    const T &operator[](int p_idx) const;
+
+    qint64 value(int p_idx) const;
+
+    void setValue(int p_idx, qint64 p_value);
+
+    // Append values of [@p_idx, @p_idx + @p_count) to @p_values in
+    // O(log n + @p_count).
+    void values(int p_idx, int p_count, QVector<qint64> &p_values) const;
+
+    // Sum of values in [0, @p_count).
+    qint64 prefixSum(int p_count) const;
+
+    // Sum of all the values.
+    qint64 total() const;
+
+    // Return the index i such that prefixSum(i) <= @p_sum < prefixSum(i + 1).
+    // Entries with value 0 are skipped.
+    // Return size() if @p_sum >= total().
+    int findByPrefixSum(qint64 p_sum) const;
+
+private:
+    struct Node
+    {
+        Node()
+            : m_data(),
+              m_value(0),
+              m_sum(0),
+              m_count(1),
+              m_priority(0),
+              m_left(-1),
+              m_right(-1)
+        {
+        }
+
+        T m_data;
+
+        qint64 m_value;
+
+        // Sum of values of the subtree.
+        qint64 m_sum;
+
+        // Number of entries of the subtree.
+        int m_count;
+
+        // Parents have priorities not less than their children.
+        quint32 m_priority;
+
+        // -1 for none.
+        int m_left;
+
+        int m_right;
+    };
+
+    int count(int p_node) const;
+
+    qint64 sum(int p_node) const;
+
+    // Update m_count and m_sum of @p_node from its children.
+    void pull(int p_node);
+
+    // Split the subtree of @p_node into the first @p_count entries and the rest.
+    void split(int p_node, int p_count, int &p_left, int &p_right);
+
+    // Return the root of the concatenation of subtrees @p_left and @p_right.
+    int merge(int p_left, int p_right);
+
+    // Build a subtree of @p_count new entries in O(@p_count).
+    int build(int p_count);
+
+    void freeSubtree(int p_node);
+
+    int findNode(int p_idx) const;
+
+    quint32 nextPriority();
+
+    // Nodes indexed by node id, including freed ones.
+    QVector<Node> m_nodes;
+
+    // Ids of freed nodes to reuse.
+    QVector<int> m_freeNodes;
+
+    int m_root;
+
+    // State of the xorshift generator of priorities.
+    quint32 m_seed;
+};
+
+template <typename T>
+inline VBlockTree<T>::VBlockTree()
+    : m_root(-1),
+      m_seed(2463534242u)
+{
+}
+
+template <typename T>
+inline int VBlockTree<T>::size() const
+{
+    return count(m_root);
+}
+
+template <typename T>
+inline bool VBlockTree<T>::isEmpty() const
+{
+    return m_root == -1;
+}
+
+template <typename T>
+inline void VBlockTree<T>::clear()
+{
+    m_nodes.clear();
+    m_freeNodes.clear();
+    m_root = -1;
+}
+
+template <typename T>
+inline void VBlockTree<T>::resize(int p_size)
+{
+    Q_ASSERT(p_size >= 0);
+    int oldSize = size();
+    if (p_size > oldSize) {
+        insert(oldSize, p_size - oldSize);
+    } else if (p_size < oldSize) {
+        remove(p_size, oldSize - p_size);
+    }
+}
+
+template <typename T>
+inline void VBlockTree<T>::insert(int p_idx, int p_count)
+{
+    Q_ASSERT(p_idx >= 0 && p_idx <= size());
+    if (p_count <= 0) {
+        return;
+    }
+
+    int sub = build(p_count);
+    int left, right;
+    split(m_root, p_idx, left, right);
+    m_root = merge(merge(left, sub), right);
+}
+
+template <typename T>
+inline void VBlockTree<T>::remove(int p_idx, int p_count)
+{
+    Q_ASSERT(p_idx >= 0 && p_idx + p_count <= size());
+    if (p_count <= 0) {
+        return;
+    }
+
+    int left, mid, right;
+    split(m_root, p_idx, left, mid);
+    split(mid, p_count, mid, right);
+    freeSubtree(mid);
+    m_root = merge(left, right);
+}
+
+template <typename T>
+inline T &VBlockTree<T>::operator[](int p_idx)
+{
+    return m_nodes[findNode(p_idx)].m_data;
+}
+
+template <typename T>
+inline const T &VBlockTree<T>::operator[](int p_idx) const
+{
+    return m_nodes[findNode(p_idx)].m_data;
+}
+
+template <typename T>
+inline qint64 VBlockTree<T>::value(int p_idx) const
+{
+    return m_nodes[findNode(p_idx)].m_value;
+}
+
+template <typename T>
+inline void VBlockTree<T>::setValue(int p_idx, qint64 p_value)
+{
+    Q_ASSERT(p_value >= 0);
+    qint64 delta = p_value - value(p_idx);
+    if (delta == 0) {
+        return;
+    }
+
+    // Add the delta to the sums along the path to the entry.
+    int node = m_root;
+    int idx = p_idx;
+    while (true) {
+        Node &nd = m_nodes[node];
+        nd.m_sum += delta;
+        int leftCount = count(nd.m_left);
+        if (idx < leftCount) {
+            node = nd.m_left;
+        } else if (idx == leftCount) {
+            nd.m_value = p_value;
+            break;
+        } else {
+            idx -= leftCount + 1;
+            node = nd.m_right;
+        }
+    }
+}
+
+template <typename T>
+inline void VBlockTree<T>::values(int p_idx, int p_count, QVector<qint64> &p_values) const
+{
+    Q_ASSERT(p_idx >= 0 && p_count >= 0 && p_idx + p_count <= size());
+    if (p_count == 0) {
+        return;
+    }
+
+    // Ancestors after the current node in order.
+    QVector<int> ancestors;
+    int node = m_root;
+    int idx = p_idx;
+    while (true) {
+        const Node &nd = m_nodes[node];
+        int leftCount = count(nd.m_left);
+        if (idx < leftCount) {
+            ancestors.append(node);
+            node = nd.m_left;
+        } else if (idx == leftCount) {
+            break;
+        } else {
+            idx -= leftCount + 1;
+            node = nd.m_right;
+        }
+    }
+
+    for (int i = 0; i < p_count; ++i) {
+        p_values.append(m_nodes[node].m_value);
+        if (i == p_count - 1) {
+            break;
+        }
+
+        if (m_nodes[node].m_right != -1) {
+            node = m_nodes[node].m_right;
+            while (m_nodes[node].m_left != -1) {
+                ancestors.append(node);
+                node = m_nodes[node].m_left;
+            }
+        } else {
+            node = ancestors.takeLast();
+        }
+    }
+}
+
+template <typename T>
+inline qint64 VBlockTree<T>::prefixSum(int p_count) const
+{
+    Q_ASSERT(p_count >= 0 && p_count <= size());
+    qint64 ret = 0;
+    int node = m_root;
+    int cnt = p_count;
+    while (node != -1 && cnt > 0) {
+        const Node &nd = m_nodes[node];
+        int leftCount = count(nd.m_left);
+        if (cnt <= leftCount) {
+            node = nd.m_left;
+        } else {
+            ret += sum(nd.m_left) + nd.m_value;
+            cnt -= leftCount + 1;
+            node = nd.m_right;
+        }
+    }
+
+    return ret;
+}
+
+template <typename T>
+inline qint64 VBlockTree<T>::total() const
+{
+    return sum(m_root);
+}
+
+template <typename T>
+inline int VBlockTree<T>::findByPrefixSum(qint64 p_sum) const
+{
+    if (p_sum < 0) {
+        return 0;
+    }
+
+    int idx = 0;
+    int node = m_root;
+    qint64 rem = p_sum;
+    while (node != -1) {
+        const Node &nd = m_nodes[node];
+        qint64 leftSum = sum(nd.m_left);
+        if (rem < leftSum) {
+            node = nd.m_left;
+            continue;
+        }
+
+        rem -= leftSum;
+        idx += count(nd.m_left);
+        if (rem < nd.m_value) {
+            return idx;
+        }
+
+        rem -= nd.m_value;
+        ++idx;
+        node = nd.m_right;
+    }
+
+    return idx;
+}
+
+template <typename T>
+inline int VBlockTree<T>::count(int p_node) const
+{
+    return p_node == -1 ? 0 : m_nodes[p_node].m_count;
+}
+
+template <typename T>
+inline qint64 VBlockTree<T>::sum(int p_node) const
+{
+    return p_node == -1 ? 0 : m_nodes[p_node].m_sum;
+}
+
+template <typename T>
+inline void VBlockTree<T>::pull(int p_node)
+{
+    Node &nd = m_nodes[p_node];
+    nd.m_count = count(nd.m_left) + 1 + count(nd.m_right);
+    nd.m_sum = sum(nd.m_left) + nd.m_value + sum(nd.m_right);
+}
+
+template <typename T>
+inline void VBlockTree<T>::split(int p_node, int p_count, int &p_left, int &p_right)
+{
+    if (p_node == -1) {
+        p_left = p_right = -1;
+        return;
+    }
+
+    int leftCount = count(m_nodes[p_node].m_left);
+    if (p_count <= leftCount) {
+        int left;
+        split(m_nodes[p_node].m_left, p_count, p_left, left);
+        m_nodes[p_node].m_left = left;
+        p_right = p_node;
+    } else {
+        int right;
+        split(m_nodes[p_node].m_right, p_count - leftCount - 1, right, p_right);
+        m_nodes[p_node].m_right = right;
+        p_left = p_node;
+    }
+
+    pull(p_node);
+}
+
+template <typename T>
+inline int VBlockTree<T>::merge(int p_left, int p_right)
+{
+    if (p_left == -1) {
+        return p_right;
+    } else if (p_right == -1) {
+        return p_left;
+    }
+
+    if (m_nodes[p_left].m_priority >= m_nodes[p_right].m_priority) {
+        int right = merge(m_nodes[p_left].m_right, p_right);
+        m_nodes[p_left].m_right = right;
+        pull(p_left);
+        return p_left;
+    } else {
+        int left = merge(p_left, m_nodes[p_right].m_left);
+        m_nodes[p_right].m_left = left;
+        pull(p_right);
+        return p_right;
+    }
+}
+
+template <typename T>
+inline int VBlockTree<T>::build(int p_count)
+{
+    // Build the Cartesian tree of the new nodes by their priorities with a
+    // stack of the right spine.
+    QVector<int> spine;
+    for (int i = 0; i < p_count; ++i) {
+        int node;
+        if (m_freeNodes.isEmpty()) {
+            node = m_nodes.size();
+            m_nodes.append(Node());
+        } else {
+            node = m_freeNodes.takeLast();
+            m_nodes[node] = Node();
+        }
+
+        m_nodes[node].m_priority = nextPriority();
+
+        int last = -1;
+        while (!spine.isEmpty()
+               && m_nodes[spine.last()].m_priority < m_nodes[node].m_priority) {
+            last = spine.takeLast();
+            pull(last);
+        }
+
+        m_nodes[node].m_left = last;
+        if (!spine.isEmpty()) {
+            m_nodes[spine.last()].m_right = node;
+        }
+
+        spine.append(node);
+    }
+
+    while (spine.size() > 1) {
+        pull(spine.takeLast());
+    }
+
+    pull(spine.first());
+    return spine.first();
+}
+
+template <typename T>
+inline void VBlockTree<T>::freeSubtree(int p_node)
+{
+    QVector<int> nodes;
+    if (p_node != -1) {
+        nodes.append(p_node);
+    }
+
+    while (!nodes.isEmpty()) {
+        int node = nodes.takeLast();
+        Node &nd = m_nodes[node];
+        if (nd.m_left != -1) {
+            nodes.append(nd.m_left);
+        }
+
+        if (nd.m_right != -1) {
+            nodes.append(nd.m_right);
+        }
+
+        // Release the resources of the payload.
+        nd = Node();
+        m_freeNodes.append(node);
+    }
+}
+
+template <typename T>
+inline int VBlockTree<T>::findNode(int p_idx) const
+{
+    Q_ASSERT(p_idx >= 0 && p_idx < size());
+    int node = m_root;
+    int idx = p_idx;
+    while (true) {
+        const Node &nd = m_nodes[node];
+        int leftCount = count(nd.m_left);
+        if (idx < leftCount) {
+            node = nd.m_left;
+        } else if (idx == leftCount) {
+            return node;
+        } else {
+            idx -= leftCount + 1;
+            node = nd.m_right;
+        }
+    }
+}
+
+template <typename T>
+inline quint32 VBlockTree<T>::nextPriority()
+{
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+    return m_seed;
+}
+
+#endif // VBLOCKTREE_H
@@ -0,0 +1,110 @@
+#include "vbulklayoutjob.h"
+
+#include <QRunnable>
+#include <QThreadPool>
+
+#include "vtextdocumentlayout.h"
+#include "vtracer.h"
+
+
+// Number of blocks measured by one task.
+static const int c_chunkSize = 512;
+
+
+class VBulkLayoutTask : public QRunnable
+{
+public:
+    VBulkLayoutTask(const QSharedPointer<VBulkLayoutJob> &p_job,
+                    int p_begin,
+                    int p_end)
+        : m_job(p_job),
+          m_begin(p_begin),
+          m_end(p_end)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        m_job->measure(m_begin, m_end);
+    }
+
+private:
+    QSharedPointer<VBulkLayoutJob> m_job;
+
+    int m_begin;
+
+    int m_end;
+};
+
+
+VBulkLayoutJob::VBulkLayoutJob(int p_generation,
+                               int p_firstBlock,
+                               QVector<Input> &p_inputs,
+                               const QTextOption &p_option,
+                               qreal p_margin,
+                               qreal p_leading)
+    : QObject(nullptr),
+      m_generation(p_generation),
+      m_firstBlock(p_firstBlock),
+      m_option(p_option),
+      m_margin(p_margin),
+      m_leading(p_leading),
+      m_cancelled(0)
+{
+    // Make sure the vectors are not shared, so tasks will not detach them.
+    m_inputs.swap(p_inputs);
+    m_results.resize(m_inputs.size());
+}
+
+void VBulkLayoutJob::start(const QSharedPointer<VBulkLayoutJob> &p_job, QThreadPool *p_pool)
+{
+    const int cnt = p_job->m_inputs.size();
+    for (int i = 0; i < cnt; i += c_chunkSize) {
+        p_pool->start(new VBulkLayoutTask(p_job, i, qMin(i + c_chunkSize, cnt)));
+    }
+}
+
+void VBulkLayoutJob::cancel()
+{
+    m_cancelled.storeRelease(1);
+}
+
+bool VBulkLayoutJob::isCancelled() const
+{
+    return m_cancelled.loadAcquire() != 0;
+}
+
+int VBulkLayoutJob::chunkCount() const
+{
+    return (m_inputs.size() + c_chunkSize - 1) / c_chunkSize;
+}
+
+void VBulkLayoutJob::measure(int p_begin, int p_end)
+{
+    V_TRACE_SPAN_ARG("measureBlocks", m_firstBlock + p_begin);
+
+    Input *inputs = m_inputs.data();
+    Result *results = m_results.data();
+    for (int i = p_begin; i < p_end; ++i) {
+        if (isCancelled()) {
+            return;
+        }
+
+        QTextLayout tl(inputs[i].m_text, inputs[i].m_font);
+        tl.setTextOption(m_option);
+        tl.setFormats(inputs[i].m_formats);
+        VTextDocumentLayout::layoutLines(&tl, inputs[i].m_availableWidth, m_margin, m_leading);
+
+        Result &res = results[i];
+        res.m_rect = tl.boundingRect();
+        res.m_lineCount = tl.lineCount();
+        if (res.m_lineCount > 0) {
+            res.m_firstLineWidth = tl.lineAt(0).naturalTextWidth();
+        }
+
+        // Release the text as soon as possible.
+        inputs[i] = Input();
+    }
+
+    emit chunkFinished(m_generation, m_firstBlock + p_begin, p_end - p_begin);
+}
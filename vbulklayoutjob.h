@@ -0,0 +1,142 @@
+#ifndef VBULKLAYOUTJOB_H
+#define VBULKLAYOUTJOB_H
+
+#include <QObject>
+#include <QVector>
+#include <QString>
+#include <QFont>
+#include <QRectF>
+#include <QTextOption>
+#include <QTextLayout>
+#include <QAtomicInt>
+#include <QSharedPointer>
+
+class QThreadPool;
+
+
+// Measure the geometry of a range of blocks concurrently on a thread pool.
+// Each block is laid out by a detached QTextLayout built from the block text
+// and formats. chunkFinished() is delivered to the thread the job lives in,
+// where the results could be published.
+class VBulkLayoutJob : public QObject
+{
+    Q_OBJECT
+public:
+    struct Input
+    {
+        Input()
+            : m_availableWidth(0)
+        {
+        }
+
+        QString m_text;
+
+        QVector<QTextLayout::FormatRange> m_formats;
+
+        // Font of the block, which is the one of its char format.
+        QFont m_font;
+
+        // Available width for the lines with m_font.
+        qreal m_availableWidth;
+    };
+
+    struct Result
+    {
+        Result()
+            : m_lineCount(0),
+              m_firstLineWidth(0)
+        {
+        }
+
+        // Bounding rect of the text layout.
+        QRectF m_rect;
+
+        int m_lineCount;
+
+        // Natural text width of the first line.
+        qreal m_firstLineWidth;
+    };
+
+    // @p_generation: identifies this job in chunkFinished(), since a stale
+    // chunk may arrive after the job is gone.
+    // @p_firstBlock: block number of the first input.
+    // @p_inputs: will be taken over by the job.
+    VBulkLayoutJob(int p_generation,
+                   int p_firstBlock,
+                   QVector<Input> &p_inputs,
+                   const QTextOption &p_option,
+                   qreal p_margin,
+                   qreal p_leading);
+
+    // Queue all the chunks of @p_job to @p_pool.
+    // Tasks hold a reference of @p_job, so the job should be created with
+    // QObject::deleteLater() as the deleter.
+    static void start(const QSharedPointer<VBulkLayoutJob> &p_job, QThreadPool *p_pool);
+
+    // Tasks not started yet will do nothing.
+    void cancel();
+
+    bool isCancelled() const;
+
+    int generation() const;
+
+    int firstBlock() const;
+
+    int blockCount() const;
+
+    int chunkCount() const;
+
+    // Only valid for blocks which have been published by chunkFinished().
+    const Result &result(int p_blockNumber) const;
+
+signals:
+    // Blocks [@p_first, @p_first + @p_count) of job @p_generation have been
+    // measured.
+    void chunkFinished(int p_generation, int p_first, int p_count);
+
+private:
+    // Measure inputs [@p_begin, @p_end).
+    // Called in the worker threads.
+    void measure(int p_begin, int p_end);
+
+    int m_generation;
+
+    int m_firstBlock;
+
+    // Each task only touches its own range of m_inputs and m_results.
+    QVector<Input> m_inputs;
+
+    QVector<Result> m_results;
+
+    QTextOption m_option;
+
+    qreal m_margin;
+
+    qreal m_leading;
+
+    QAtomicInt m_cancelled;
+
+    friend class VBulkLayoutTask;
+};
+
+inline int VBulkLayoutJob::generation() const
+{
+    return m_generation;
+}
+
+inline int VBulkLayoutJob::firstBlock() const
+{
+    return m_firstBlock;
+}
+
+inline int VBulkLayoutJob::blockCount() const
+{
+    return m_results.size();
+}
+
+inline const VBulkLayoutJob::Result &VBulkLayoutJob::result(int p_blockNumber) const
+{
+    return m_results.at(p_blockNumber - m_firstBlock);
+}
+
+#endif // VBULKLAYOUTJOB_H
@@ -0,0 +1,191 @@
+#include "vcodeblockindex.h"
+
+#include <QTextDocument>
+#include <QTextBlock>
+
+#include "vtracer.h"
+
+
+VCodeBlockIndex::VCodeBlockIndex(const QTextDocument *p_doc,
+                                 int p_startState,
+                                 int p_endState)
+    : m_doc(p_doc),
+      m_startState(p_startState),
+      m_endState(p_endState),
+      m_valid(false),
+      m_blockCount(0),
+      m_dirtyFirst(-1),
+      m_dirtyLast(-1)
+{
+}
+
+void VCodeBlockIndex::contentsChange(int p_position, int p_charsRemoved, int p_charsAdded)
+{
+    Q_UNUSED(p_charsRemoved);
+
+    if (!m_valid) {
+        return;
+    }
+
+    int blockCount = m_doc->blockCount();
+    int blockCountDelta = blockCount - m_blockCount;
+    m_blockCount = blockCount;
+
+    int first = m_doc->findBlock(p_position).blockNumber();
+    if (first == -1) {
+        first = blockCount - 1;
+    }
+
+    int last = m_doc->findBlock(p_position + p_charsAdded).blockNumber();
+    if (last == -1) {
+        last = blockCount - 1;
+    }
+
+    // Blocks [first, oldLast] in the old document are replaced by blocks
+    // [first, last]. Drop their markers and shift the ones behind.
+    int oldLast = last - blockCountDelta;
+    int firstIdx = lowerBound(first);
+    int lastIdx = firstIdx;
+    while (lastIdx < m_markers.size() && m_markers[lastIdx].m_blockNumber <= oldLast) {
+        ++lastIdx;
+    }
+
+    m_markers.remove(firstIdx, lastIdx - firstIdx);
+    if (blockCountDelta != 0) {
+        for (int i = firstIdx; i < m_markers.size(); ++i) {
+            m_markers[i].m_blockNumber += blockCountDelta;
+        }
+    }
+
+    if (m_dirtyFirst == -1) {
+        m_dirtyFirst = first;
+        m_dirtyLast = last;
+    } else {
+        if (m_dirtyFirst > oldLast) {
+            m_dirtyFirst += blockCountDelta;
+        }
+
+        if (m_dirtyLast > oldLast) {
+            m_dirtyLast += blockCountDelta;
+        }
+
+        m_dirtyFirst = qMin(m_dirtyFirst, first);
+        m_dirtyLast = qMax(m_dirtyLast, last);
+    }
+}
+
+void VCodeBlockIndex::clear()
+{
+    m_markers.clear();
+    m_valid = false;
+    m_dirtyFirst = m_dirtyLast = -1;
+}
+
+int VCodeBlockIndex::findCodeBlockStart(int p_blockNumber)
+{
+    if (!m_valid || m_blockCount != m_doc->blockCount()) {
+        build();
+    } else if (m_dirtyFirst > -1) {
+        refresh();
+    }
+
+    int idx = lowerBound(p_blockNumber) - 1;
+    while (idx >= 0 && !m_markers[idx].m_start) {
+        --idx;
+    }
+
+    return idx >= 0 ? m_markers[idx].m_blockNumber : -1;
+}
+
+void VCodeBlockIndex::build()
+{
+    V_TRACE_SPAN("buildCodeBlockIndex");
+
+    m_markers.clear();
+    m_blockCount = m_doc->blockCount();
+    m_dirtyFirst = m_dirtyLast = -1;
+
+    QTextBlock block = m_doc->begin();
+    while (block.isValid()) {
+        int state = block.userState();
+        if (state == m_startState || state == m_endState) {
+            Marker marker;
+            marker.m_blockNumber = block.blockNumber();
+            marker.m_start = state == m_startState;
+            m_markers.append(marker);
+        }
+
+        block = block.next();
+    }
+
+    m_valid = true;
+}
+
+void VCodeBlockIndex::refresh()
+{
+    int first = m_dirtyFirst;
+    int last = qMin(m_dirtyLast, m_blockCount - 1);
+    m_dirtyFirst = m_dirtyLast = -1;
+    if (first < 0 || first > last) {
+        return;
+    }
+
+    // Drop the markers of the changed blocks and scan them again.
+    int firstIdx = lowerBound(first);
+    int lastIdx = firstIdx;
+    while (lastIdx < m_markers.size() && m_markers[lastIdx].m_blockNumber <= last) {
+        ++lastIdx;
+    }
+
+    QVector<Marker> markers;
+    QTextBlock block = m_doc->findBlockByNumber(first);
+    for (int num = first; num <= last && block.isValid(); ++num) {
+        int state = block.userState();
+        if (state == m_startState || state == m_endState) {
+            Marker marker;
+            marker.m_blockNumber = num;
+            marker.m_start = state == m_startState;
+            markers.append(marker);
+        }
+
+        block = block.next();
+    }
+
+    m_markers = m_markers.mid(0, firstIdx) + markers + m_markers.mid(lastIdx);
+
+    // A change may flip the code blocks behind, such as adding an opening
+    // fence. Check the markers behind until one is unchanged, like how the
+    // highlighter stops once the state of a block does not change.
+    int idx = firstIdx + markers.size();
+    while (idx < m_markers.size()) {
+        Marker &marker = m_markers[idx];
+        int state = m_doc->findBlockByNumber(marker.m_blockNumber).userState();
+        if (state != m_startState && state != m_endState) {
+            m_markers.remove(idx);
+            continue;
+        }
+
+        bool start = state == m_startState;
+        if (start == marker.m_start) {
+            break;
+        }
+
+        marker.m_start = start;
+        ++idx;
+    }
+}
+
+int VCodeBlockIndex::lowerBound(int p_blockNumber) const
+{
+    int lo = 0, hi = m_markers.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m_markers[mid].m_blockNumber < p_blockNumber) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
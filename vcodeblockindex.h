@@ -0,0 +1,69 @@
+#ifndef VCODEBLOCKINDEX_H
+#define VCODEBLOCKINDEX_H
+
+#include <QVector>
+
+class QTextDocument;
+
+
+// An index of the code blocks of a document by the user states of its blocks,
+// to find the block starting the code block of any block in O(log n).
+// Only the blocks starting or ending code blocks are kept, sorted by number.
+// Changed blocks are rescanned lazily on next lookup. The blocks starting or
+// ending code blocks behind are checked one by one until one is unchanged,
+// since a change may flip all the code blocks behind it.
+class VCodeBlockIndex
+{
+public:
+    // @p_startState, @p_endState: user states of the blocks starting or ending
+    // a code block.
+    VCodeBlockIndex(const QTextDocument *p_doc, int p_startState, int p_endState);
+
+    // Should be called on QTextDocument::contentsChange().
+    void contentsChange(int p_position, int p_charsRemoved, int p_charsAdded);
+
+    // Drop the index, which will be built again on next lookup.
+    void clear();
+
+    // Return the number of the nearest block starting a code block before
+    // block @p_blockNumber, or -1 if none.
+    int findCodeBlockStart(int p_blockNumber);
+
+private:
+    // A block starting or ending a code block.
+    struct Marker
+    {
+        int m_blockNumber;
+
+        bool m_start;
+    };
+
+    void build();
+
+    // Rescan the changed blocks.
+    void refresh();
+
+    // Index of the first marker with block number not less than @p_blockNumber.
+    int lowerBound(int p_blockNumber) const;
+
+    const QTextDocument *m_doc;
+
+    int m_startState;
+
+    int m_endState;
+
+    QVector<Marker> m_markers;
+
+    // Whether m_markers is built.
+    bool m_valid;
+
+    // Block count of the document when last updated.
+    int m_blockCount;
+
+    // Range of changed blocks to rescan, or -1 if none.
+    int m_dirtyFirst;
+
+    int m_dirtyLast;
+};
+
+#endif // VCODEBLOCKINDEX_H
@@ -1,61 +1,1295 @@
 #include "vimageresourcemanager2.h"
 
 #include <QDebug>
+#include <QRunnable>
+#include <QImageReader>
+#include <QBuffer>
+#include <QMap>
+#include <QScopedPointer>
 
 #include "vtextedit.h"
+#include "vtracer.h"
+#include "vimagestore.h"
 
 
-VImageResourceManager2::VImageResourceManager2()
+// Default memory limit of the scaled variants of images in bytes.
+static const int c_defaultScaledImageCacheLimit = 64 * 1024 * 1024;
+
+// Default memory limit of the decoded images in bytes.
+static const qint64 c_defaultImageMemoryLimit = 256 * 1024 * 1024;
+
+// Maximum number of halved levels kept for an image decoded at a bounded size.
+static const int c_maximumMipmapLevels = 3;
+
+// Do not halve images narrower than this.
+static const int c_minimumMipmapWidth = 256;
+
+// Delay in ms of animation frames without a valid one, like browsers do.
+static const int c_defaultFrameDelay = 100;
+
+// Delay in ms to show a frame with delay @p_delay given by the image.
+static int normalizeFrameDelay(int p_delay)
+{
+    return p_delay <= 10 ? c_defaultFrameDelay : p_delay;
+}
+
+static qint64 imageBytes(const QPixmap &p_image)
 {
+    return (qint64)p_image.width() * p_image.height() * p_image.depth() / 8;
+}
+
+
+// Scale an image smoothly and deliver it back to the manager.
+class VImageScaleTask : public QRunnable
+{
+public:
+    VImageScaleTask(VImageResourceManager2 *p_manager,
+                    int p_handle,
+                    qint64 p_sourceKey,
+                    const QImage &p_source,
+                    const QSize &p_size,
+                    qreal p_devicePixelRatio)
+        : m_manager(p_manager),
+          m_handle(p_handle),
+          m_sourceKey(p_sourceKey),
+          m_source(p_source),
+          m_size(p_size),
+          m_devicePixelRatio(p_devicePixelRatio)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        V_TRACE_SPAN("scaleImage");
+
+        QSize pixelSize = m_size * m_devicePixelRatio;
+        QImage image = m_source.scaled(pixelSize,
+                                       Qt::IgnoreAspectRatio,
+                                       Qt::SmoothTransformation);
+        // Release the source before waiting for the GUI thread.
+        m_source = QImage();
+
+        // The manager waits for all the tasks before being destructed.
+        QMetaObject::invokeMethod(m_manager,
+                                  "handleScaledImage",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, m_handle),
+                                  Q_ARG(qint64, m_sourceKey),
+                                  Q_ARG(QSize, m_size),
+                                  Q_ARG(double, m_devicePixelRatio),
+                                  Q_ARG(QImage, image));
+    }
+
+private:
+    VImageResourceManager2 *m_manager;
+
+    int m_handle;
+
+    qint64 m_sourceKey;
+
+    QImage m_source;
+
+    QSize m_size;
+
+    qreal m_devicePixelRatio;
+};
+
+
+// Compute the content key of an image file or data for VImageStore and
+// deliver it back to the manager, which may read a large file.
+class VImageHashTask : public QRunnable
+{
+public:
+    VImageHashTask(VImageResourceManager2 *p_manager,
+                   int p_handle,
+                   int p_serial,
+                   const QString &p_filePath,
+                   const QByteArray &p_data)
+        : m_manager(p_manager),
+          m_handle(p_handle),
+          m_serial(p_serial),
+          m_filePath(p_filePath),
+          m_data(p_data)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        V_TRACE_SPAN("hashImage");
+
+        QByteArray contentKey = m_filePath.isEmpty() ? VImageStore::contentKey(m_data)
+                                                     : VImageStore::fileContentKey(m_filePath);
+        m_data.clear();
+
+        // The manager waits for all the tasks before being destructed.
+        QMetaObject::invokeMethod(m_manager,
+                                  "handleHashedImage",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, m_handle),
+                                  Q_ARG(int, m_serial),
+                                  Q_ARG(QByteArray, contentKey));
+    }
+
+private:
+    VImageResourceManager2 *m_manager;
+
+    int m_handle;
+
+    int m_serial;
+
+    QString m_filePath;
+
+    QByteArray m_data;
+};
+
+
+// Decode an image from a file or data and deliver it back to the manager.
+class VImageDecodeTask : public QRunnable
+{
+public:
+    VImageDecodeTask(VImageResourceManager2 *p_manager,
+                     int p_handle,
+                     int p_serial,
+                     const QString &p_filePath,
+                     const QByteArray &p_data,
+                     int p_maximumWidth)
+        : m_manager(p_manager),
+          m_handle(p_handle),
+          m_serial(p_serial),
+          m_filePath(p_filePath),
+          m_data(p_data),
+          m_maximumWidth(p_maximumWidth)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        V_TRACE_SPAN("decodeImage");
+
+        QSize originalSize;
+        QImage image;
+        bool animated = false;
+        int delay = 0;
+        if (m_filePath.isEmpty()) {
+            QBuffer buffer(&m_data);
+            QImageReader reader(&buffer);
+            image = read(reader, originalSize, animated, delay);
+        } else {
+            QImageReader reader(m_filePath);
+            image = read(reader, originalSize, animated, delay);
+        }
+
+        m_data.clear();
+
+        // Frames of an animated image replace each other and have no levels.
+        QVector<QImage> mipmaps;
+        if (!image.isNull() && !animated && image.size() != originalSize) {
+            // Keep a few halved levels for smaller zoom levels.
+            QImage level = image;
+            while (mipmaps.size() < c_maximumMipmapLevels
+                   && level.width() / 2 >= c_minimumMipmapWidth) {
+                level = level.scaled(level.size() / 2,
+                                     Qt::IgnoreAspectRatio,
+                                     Qt::SmoothTransformation);
+                mipmaps.append(level);
+            }
+        }
+
+        // The manager waits for all the tasks before being destructed.
+        QMetaObject::invokeMethod(m_manager,
+                                  "handleDecodedImage",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, m_handle),
+                                  Q_ARG(int, m_serial),
+                                  Q_ARG(QSize, originalSize),
+                                  Q_ARG(QImage, image),
+                                  Q_ARG(QVector<QImage>, mipmaps),
+                                  Q_ARG(bool, animated),
+                                  Q_ARG(int, delay));
+    }
+
+private:
+    // Read the image, or its first frame, at most m_maximumWidth wide.
+    // @p_animated: whether it has more frames.
+    // @p_delay: delay in ms to show the frame read if animated.
+    QImage read(QImageReader &p_reader,
+                QSize &p_originalSize,
+                bool &p_animated,
+                int &p_delay) const
+    {
+        p_animated = false;
+        p_originalSize = p_reader.size();
+        if (m_maximumWidth > 0
+            && p_originalSize.isValid()
+            && p_originalSize.width() > m_maximumWidth) {
+            // Let the decoder downsample, which needs much less memory.
+            p_reader.setScaledSize(p_originalSize.scaled(m_maximumWidth,
+                                                         p_originalSize.height(),
+                                                         Qt::KeepAspectRatio));
+        }
+
+        QImage image = p_reader.read();
+        if (image.isNull()) {
+            return image;
+        }
+
+        // Checking for the next frame avoids scanning all the frames as
+        // imageCount() does.
+        if (p_reader.supportsAnimation() && p_reader.canRead()) {
+            p_animated = true;
+            p_delay = normalizeFrameDelay(p_reader.nextImageDelay());
+        }
+
+        if (!p_originalSize.isValid()) {
+            // Size is unknown from the header.
+            p_originalSize = image.size();
+            if (m_maximumWidth > 0 && image.width() > m_maximumWidth) {
+                image = image.scaledToWidth(m_maximumWidth, Qt::SmoothTransformation);
+            }
+        }
+
+        return image;
+    }
+
+    VImageResourceManager2 *m_manager;
+
+    int m_handle;
+
+    int m_serial;
+
+    QString m_filePath;
+
+    QByteArray m_data;
+
+    int m_maximumWidth;
+};
+
+
+// Frames of an animated image, read one at a time by VImageFrameTask in the
+// decoding threads so that only the current and the next frames are kept in
+// memory. Used by one task at a time.
+class VImageAnimation
+{
+public:
+    // @p_skipFirstFrame: whether the first frame has been read by the
+    // decoding already.
+    VImageAnimation(const QString &p_filePath,
+                    const QByteArray &p_data,
+                    int p_maximumWidth,
+                    bool p_skipFirstFrame)
+        : m_filePath(p_filePath),
+          m_data(p_data),
+          m_maximumWidth(p_maximumWidth),
+          m_skipFirstFrame(p_skipFirstFrame),
+          m_frameDelay(c_defaultFrameDelay)
+    {
+    }
+
+    // Start over from the first frame.
+    void rewind()
+    {
+        m_reader.reset();
+        if (m_filePath.isEmpty()) {
+            m_buffer.close();
+            m_buffer.setBuffer(&m_data);
+            m_buffer.open(QIODevice::ReadOnly);
+            m_reader.reset(new QImageReader(&m_buffer));
+        } else {
+            m_reader.reset(new QImageReader(m_filePath));
+        }
+
+        QSize size = m_reader->size();
+        if (m_maximumWidth > 0 && size.isValid() && size.width() > m_maximumWidth) {
+            m_reader->setScaledSize(size.scaled(m_maximumWidth,
+                                                size.height(),
+                                                Qt::KeepAspectRatio));
+        }
+    }
+
+    // Read the next frame. Loop from the first frame after the last one.
+    // Return a null image if failed.
+    QImage readFrame()
+    {
+        V_TRACE_SPAN("readAnimationFrame");
+
+        if (!m_reader) {
+            rewind();
+            if (m_skipFirstFrame) {
+                m_reader->read();
+            }
+        }
+
+        QImage frame = m_reader->read();
+        if (frame.isNull()) {
+            rewind();
+            frame = m_reader->read();
+        }
+
+        m_frameDelay = normalizeFrameDelay(m_reader->nextImageDelay());
+        return frame;
+    }
+
+    // Delay in ms of the frame read last.
+    int frameDelay() const
+    {
+        return m_frameDelay;
+    }
+
+private:
+    QString m_filePath;
+
+    QByteArray m_data;
+
+    QBuffer m_buffer;
+
+    QScopedPointer<QImageReader> m_reader;
+
+    int m_maximumWidth;
+
+    bool m_skipFirstFrame;
+
+    int m_frameDelay;
+};
+
+
+// Read the next frame of an animated image and deliver it back to the manager.
+class VImageFrameTask : public QRunnable
+{
+public:
+    VImageFrameTask(VImageResourceManager2 *p_manager,
+                    int p_handle,
+                    int p_serial,
+                    const QSharedPointer<VImageAnimation> &p_animation)
+        : m_manager(p_manager),
+          m_handle(p_handle),
+          m_serial(p_serial),
+          m_animation(p_animation)
+    {
+    }
+
+    void run() Q_DECL_OVERRIDE
+    {
+        QImage frame = m_animation->readFrame();
+
+        // The manager waits for all the tasks before being destructed.
+        QMetaObject::invokeMethod(m_manager,
+                                  "handleAnimationFrame",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, m_handle),
+                                  Q_ARG(int, m_serial),
+                                  Q_ARG(QImage, frame),
+                                  Q_ARG(int, m_animation->frameDelay()));
+    }
+
+private:
+    VImageResourceManager2 *m_manager;
+
+    int m_handle;
+
+    int m_serial;
+
+    // Shared with the manager, which may drop it before this task finishes.
+    QSharedPointer<VImageAnimation> m_animation;
+};
+
+
+VImageResourceManager2::VImageResourceManager2(QObject *p_parent)
+    : QObject(p_parent),
+      m_decodeSerial(0),
+      m_useClock(0),
+      m_scaledUseClock(0),
+      m_activeFirstBlock(-1),
+      m_activeLastBlock(-1),
+      m_visibleFirstBlock(-1),
+      m_visibleLastBlock(-1),
+      m_reloadPending(false),
+      m_imageMemoryLimit(c_defaultImageMemoryLimit),
+      m_residentImageBytes(0),
+      m_scaledImageLimit(c_defaultScaledImageCacheLimit),
+      m_scaledImageBytes(0),
+      m_maximumDecodeWidth(0)
+{
+    qRegisterMetaType<QVector<QImage> >();
+
+    m_workerPool.setMaxThreadCount(1);
+
+    m_animationTimer.setSingleShot(true);
+    connect(&m_animationTimer, &QTimer::timeout,
+            this, &VImageResourceManager2::advanceAnimations);
+    m_animationClock.start();
+}
+
+VImageResourceManager2::~VImageResourceManager2()
+{
+    m_workerPool.clear();
+    m_decodePool.clear();
+    m_workerPool.waitForDone();
+    m_decodePool.waitForDone();
+
+    clear();
+}
+
+int VImageResourceManager2::internImage(const QString &p_name)
+{
+    int handle = findHandle(p_name);
+    if (handle > -1) {
+        return handle;
+    }
+
+    if (m_freeHandles.isEmpty()) {
+        handle = m_entries.size();
+        m_entries.append(ImageEntry());
+    } else {
+        handle = m_freeHandles.takeLast();
+    }
+
+    ImageEntry &entry = m_entries[handle];
+    entry.m_valid = true;
+    entry.m_name = p_name;
+    entry.m_lastUse = m_useClock;
+    m_handles.insert(p_name, handle);
+    return handle;
+}
+
+int VImageResourceManager2::findHandle(const QString &p_name) const
+{
+    return m_handles.value(p_name, -1);
+}
+
+bool VImageResourceManager2::isValidHandle(int p_handle) const
+{
+    return p_handle >= 0 && p_handle < m_entries.size() && m_entries[p_handle].m_valid;
+}
+
+void VImageResourceManager2::freeEntry(int p_handle)
+{
+    removeScaledImages(p_handle);
+    setEntryImage(p_handle, QPixmap());
+
+    ImageEntry &entry = m_entries[p_handle];
+    m_handles.remove(entry.m_name);
+    entry = ImageEntry();
+    m_freeHandles.append(p_handle);
+}
+
+void VImageResourceManager2::setEntryImage(int p_handle,
+                                           const QPixmap &p_image,
+                                           const QVector<QPixmap> &p_mipmaps)
+{
+    ImageEntry &entry = m_entries[p_handle];
+    if (!entry.m_image.isNull() && !entry.m_contentKey.isEmpty()) {
+        VImageStore::instance().release(entry.m_contentKey);
+    }
+
+    m_residentImageBytes -= imageBytes(entry.m_image);
+    for (auto const & level : entry.m_mipmaps) {
+        m_residentImageBytes -= imageBytes(level);
+    }
+
+    entry.m_image = p_image;
+    entry.m_mipmaps = p_mipmaps;
+
+    m_residentImageBytes += imageBytes(entry.m_image);
+    for (auto const & level : entry.m_mipmaps) {
+        m_residentImageBytes += imageBytes(level);
+    }
+
+    updateEvictionOrder(p_handle, entry.m_lastUse);
 }
 
 void VImageResourceManager2::addImage(const QString &p_name,
                                       const QPixmap &p_image)
 {
-    m_images.insert(p_name, p_image);
+    int handle = internImage(p_name);
+    removeScaledImages(handle);
+    setEntryImage(handle, p_image);
+
+    ImageEntry &entry = m_entries[handle];
+    entry.m_size = p_image.size();
+    // No source to evict to. Any decoding in progress is discarded.
+    // Not shared via the store, while copies of the same QPixmap are shared
+    // already.
+    entry.m_filePath.clear();
+    entry.m_data.clear();
+    entry.m_contentKey.clear();
+    entry.m_serial = 0;
+    entry.m_animation.clear();
+    entry.m_nextFrame = QImage();
+    updateEvictionOrder(handle, m_useClock);
+
+    evictImages();
+
+    // Blocks may have reserved placeholder space for it.
+    if (updateBlockImageSize(handle, entry.m_size)) {
+        emit imageSizeChanged(p_name);
+    } else {
+        emit imageUpdated(p_name);
+    }
+}
+
+bool VImageResourceManager2::addImageFromFile(const QString &p_name, const QString &p_filePath)
+{
+    if (p_filePath.isEmpty()) {
+        return false;
+    }
+
+    return decodeImage(p_name, p_filePath, QByteArray());
+}
+
+bool VImageResourceManager2::addImageFromData(const QString &p_name, const QByteArray &p_data)
+{
+    if (p_data.isEmpty()) {
+        return false;
+    }
+
+    return decodeImage(p_name, QString(), p_data);
+}
+
+bool VImageResourceManager2::addImageFromDataUrl(const QString &p_name, const QString &p_dataUrl)
+{
+    if (!p_dataUrl.startsWith(QStringLiteral("data:"), Qt::CaseInsensitive)) {
+        return false;
+    }
+
+    int idx = p_dataUrl.indexOf(QLatin1Char(','));
+    if (idx == -1) {
+        return false;
+    }
+
+    QStringRef header = p_dataUrl.midRef(5, idx - 5);
+    QByteArray payload = p_dataUrl.mid(idx + 1).toLatin1();
+    QByteArray data;
+    if (header.endsWith(QStringLiteral(";base64"), Qt::CaseInsensitive)) {
+        data = QByteArray::fromBase64(payload);
+    } else {
+        data = QByteArray::fromPercentEncoding(payload);
+    }
+
+    return addImageFromData(p_name, data);
+}
+
+bool VImageResourceManager2::decodeImage(const QString &p_name,
+                                         const QString &p_filePath,
+                                         const QByteArray &p_data)
+{
+    // Read the size from the header only.
+    QSize size;
+    QByteArray data(p_data);
+    if (p_filePath.isEmpty()) {
+        QBuffer buffer(&data);
+        QImageReader reader(&buffer);
+        if (!reader.canRead()) {
+            return false;
+        }
+
+        size = reader.size();
+    } else {
+        QImageReader reader(p_filePath);
+        if (!reader.canRead()) {
+            return false;
+        }
+
+        size = reader.size();
+    }
+
+    int handle = internImage(p_name);
+    removeScaledImages(handle);
+    setEntryImage(handle, QPixmap());
+
+    ImageEntry &entry = m_entries[handle];
+    entry.m_filePath = p_filePath;
+    entry.m_data = p_data;
+    entry.m_size = size;
+    entry.m_decodeWidth = m_maximumDecodeWidth;
+    // Hashed before decoding. Whether animated is found out by decoding.
+    entry.m_contentKey.clear();
+    entry.m_contentHashed = false;
+    entry.m_animation.clear();
+    entry.m_nextFrame = QImage();
+
+    if (updateBlockImageSize(handle, size)) {
+        emit imageSizeChanged(p_name);
+    }
+
+    loadImage(handle);
+    return true;
+}
+
+void VImageResourceManager2::loadImage(int p_handle)
+{
+    ImageEntry &entry = m_entries[p_handle];
+
+    if (entry.m_animation) {
+        // Play from the first frame. A new animation is used since a task may
+        // still be reading the old one.
+        entry.m_animation.reset(new VImageAnimation(entry.m_filePath,
+                                                    entry.m_data,
+                                                    entry.m_decodeWidth,
+                                                    false));
+        entry.m_nextFrame = QImage();
+        readNextFrame(p_handle);
+        return;
+    }
+
+    if (!entry.m_contentHashed) {
+        // Hash it first to find out whether the store has it, so that each
+        // editor opening the same image does not decode it again.
+        entry.m_serial = ++m_decodeSerial;
+        m_decodePool.start(new VImageHashTask(this,
+                                              p_handle,
+                                              entry.m_serial,
+                                              entry.m_filePath,
+                                              entry.m_data));
+        return;
+    }
+
+    // Another editor may have decoded it already.
+    VImageStore::Image image;
+    if (!entry.m_contentKey.isEmpty()
+        && VImageStore::instance().acquire(entry.m_contentKey, image)) {
+        entry.m_serial = 0;
+        entry.m_size = image.m_size;
+        setEntryImage(p_handle, image.m_image, image.m_mipmaps);
+
+        QString name = entry.m_name;
+        evictImages();
+        if (updateBlockImageSize(p_handle, image.m_size)) {
+            emit imageSizeChanged(name);
+        } else {
+            emit imageUpdated(name);
+        }
+
+        return;
+    }
+
+    entry.m_serial = ++m_decodeSerial;
+    m_decodePool.start(new VImageDecodeTask(this,
+                                            p_handle,
+                                            entry.m_serial,
+                                            entry.m_filePath,
+                                            entry.m_data,
+                                            entry.m_decodeWidth));
+}
+
+void VImageResourceManager2::readNextFrame(int p_handle)
+{
+    ImageEntry &entry = m_entries[p_handle];
+    entry.m_serial = ++m_decodeSerial;
+    m_decodePool.start(new VImageFrameTask(this,
+                                           p_handle,
+                                           entry.m_serial,
+                                           entry.m_animation));
+}
+
+void VImageResourceManager2::handleAnimationFrame(int p_handle,
+                                                  int p_serial,
+                                                  const QImage &p_frame,
+                                                  int p_delay)
+{
+    if (!isValidHandle(p_handle) || m_entries[p_handle].m_serial != p_serial) {
+        // Replaced or removed.
+        return;
+    }
+
+    ImageEntry &entry = m_entries[p_handle];
+    entry.m_serial = 0;
+    QString name = entry.m_name;
+    if (p_frame.isNull()) {
+        qWarning() << "failed to decode image" << name;
+        return;
+    }
+
+    if (entry.m_image.isNull() && !entry.m_active) {
+        // Evicted meanwhile. Played again from the first frame once active.
+        return;
+    }
+
+    if (!entry.m_image.isNull()) {
+        // Show it once the current frame is due.
+        entry.m_nextFrame = p_frame;
+        entry.m_nextFrameDelay = p_delay;
+        scheduleAnimations();
+        return;
+    }
+
+    // The first frame after being loaded or evicted.
+    setEntryImage(p_handle, QPixmap::fromImage(p_frame));
+    entry.m_nextFrameTime = m_animationClock.elapsed() + p_delay;
+    readNextFrame(p_handle);
+    evictImages();
+    emit imageUpdated(name);
+    scheduleAnimations();
+}
+
+void VImageResourceManager2::scheduleAnimations()
+{
+    qint64 nextFrameTime = -1;
+    for (int handle : m_animatedHandles) {
+        const ImageEntry &entry = m_entries[handle];
+        if (!entry.m_animation || entry.m_image.isNull() || entry.m_nextFrame.isNull()) {
+            // Scheduled once the next frame is read.
+            continue;
+        }
+
+        if (nextFrameTime == -1 || entry.m_nextFrameTime < nextFrameTime) {
+            nextFrameTime = entry.m_nextFrameTime;
+        }
+    }
+
+    if (nextFrameTime == -1) {
+        m_animationTimer.stop();
+        return;
+    }
+
+    m_animationTimer.start(qMax(nextFrameTime - m_animationClock.elapsed(), (qint64)0));
+}
+
+void VImageResourceManager2::advanceAnimations()
+{
+    V_TRACE_SPAN("advanceAnimations");
+
+    qint64 now = m_animationClock.elapsed();
+    for (int handle : m_animatedHandles) {
+        ImageEntry &entry = m_entries[handle];
+        if (!entry.m_animation
+            || entry.m_image.isNull()
+            || entry.m_nextFrame.isNull()
+            || entry.m_nextFrameTime > now) {
+            continue;
+        }
+
+        setEntryImage(handle, QPixmap::fromImage(entry.m_nextFrame));
+        entry.m_nextFrame = QImage();
+        entry.m_nextFrameTime = now + entry.m_nextFrameDelay;
+        readNextFrame(handle);
+
+        // Frames of the same image have the same size.
+        QString name = entry.m_name;
+        emit imageFrameChanged(name);
+    }
+
+    scheduleAnimations();
+}
+
+void VImageResourceManager2::setMaximumDecodeWidth(int p_width)
+{
+    m_maximumDecodeWidth = qMax(p_width, 0);
+}
+
+void VImageResourceManager2::handleHashedImage(int p_handle,
+                                               int p_serial,
+                                               const QByteArray &p_contentKey)
+{
+    if (!isValidHandle(p_handle) || m_entries[p_handle].m_serial != p_serial) {
+        // Replaced or removed.
+        return;
+    }
+
+    ImageEntry &entry = m_entries[p_handle];
+    entry.m_serial = 0;
+    entry.m_contentHashed = true;
+    if (!p_contentKey.isEmpty()) {
+        // The same content decoded at different sizes are different images.
+        entry.m_contentKey = p_contentKey + ':' + QByteArray::number(entry.m_decodeWidth);
+    }
+
+    loadImage(p_handle);
+}
+
+void VImageResourceManager2::handleDecodedImage(int p_handle,
+                                                int p_serial,
+                                                const QSize &p_originalSize,
+                                                const QImage &p_image,
+                                                const QVector<QImage> &p_mipmaps,
+                                                bool p_animated,
+                                                int p_delay)
+{
+    if (!isValidHandle(p_handle) || m_entries[p_handle].m_serial != p_serial) {
+        // Replaced or removed.
+        return;
+    }
+
+    ImageEntry &entry = m_entries[p_handle];
+    entry.m_serial = 0;
+    QString name = entry.m_name;
+
+    if (p_image.isNull()) {
+        qWarning() << "failed to decode image" << name;
+        entry.m_filePath.clear();
+        entry.m_data.clear();
+        entry.m_size = QSize();
+        if (updateBlockImageSize(p_handle, QSize())) {
+            emit imageSizeChanged(name);
+        }
+
+        return;
+    }
+
+    entry.m_size = p_originalSize;
+
+    if (p_animated) {
+        // Frames change independently in each editor and are never shared.
+        entry.m_contentKey.clear();
+        entry.m_animation.reset(new VImageAnimation(entry.m_filePath,
+                                                    entry.m_data,
+                                                    entry.m_decodeWidth,
+                                                    true));
+        setEntryImage(p_handle, QPixmap::fromImage(p_image));
+        entry.m_nextFrameTime = m_animationClock.elapsed() + p_delay;
+        readNextFrame(p_handle);
+        evictImages();
+        if (updateBlockImageSize(p_handle, p_originalSize)) {
+            emit imageSizeChanged(name);
+        } else {
+            emit imageUpdated(name);
+        }
+
+        // Played if visible.
+        scheduleAnimations();
+        return;
+    }
+
+    VImageStore::Image image;
+    image.m_image = QPixmap::fromImage(p_image);
+    image.m_mipmaps.reserve(p_mipmaps.size());
+    for (auto const & level : p_mipmaps) {
+        image.m_mipmaps.append(QPixmap::fromImage(level));
+    }
+
+    image.m_size = p_originalSize;
+    if (!entry.m_contentKey.isEmpty()) {
+        // Share it with other editors, or take the same image decoded by
+        // another editor meanwhile.
+        image = VImageStore::instance().insert(entry.m_contentKey, image);
+    }
+
+    setEntryImage(p_handle, image.m_image, image.m_mipmaps);
+    evictImages();
+
+    if (updateBlockImageSize(p_handle, p_originalSize)) {
+        emit imageSizeChanged(name);
+    } else {
+        emit imageUpdated(name);
+    }
+}
+
+bool VImageResourceManager2::updateBlockImageSize(int p_handle, const QSize &p_size)
+{
+    bool changed = false;
+    for (auto & info : m_blocksInfo) {
+        if (info.m_imageHandle == p_handle && info.m_imageSize != p_size) {
+            info.m_imageSize = p_size;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+QVector<int> VImageResourceManager2::findBlocksByImage(const QString &p_name) const
+{
+    QVector<int> blocks;
+    int handle = findHandle(p_name);
+    if (handle == -1) {
+        return blocks;
+    }
+
+    for (auto const & info : m_blocksInfo) {
+        if (info.m_imageHandle == handle) {
+            blocks.append(info.m_blockNumber);
+        }
+    }
+
+    return blocks;
 }
 
 bool VImageResourceManager2::contains(const QString &p_name) const
 {
-    return m_images.contains(p_name);
+    int handle = findHandle(p_name);
+    if (handle == -1) {
+        return false;
+    }
+
+    const ImageEntry &entry = m_entries[handle];
+    return !entry.m_image.isNull() || entry.hasSource();
 }
 
-void VImageResourceManager2::updateBlockInfos(const QVector<VBlockImageInfo2> &p_blocksInfo)
+void VImageResourceManager2::setImageMemoryLimit(qint64 p_bytes)
 {
-    QSet<QString> usedImages;
-    m_blocksInfo.clear();
+    m_imageMemoryLimit = qMax(p_bytes, (qint64)0);
+    evictImages();
+}
+
+qint64 VImageResourceManager2::residentImageBytes() const
+{
+    return m_residentImageBytes;
+}
+
+void VImageResourceManager2::setActiveBlockRange(int p_firstBlock,
+                                                 int p_lastBlock,
+                                                 int p_visibleFirstBlock,
+                                                 int p_visibleLastBlock)
+{
+    if (p_firstBlock == m_activeFirstBlock
+        && p_lastBlock == m_activeLastBlock
+        && p_visibleFirstBlock == m_visibleFirstBlock
+        && p_visibleLastBlock == m_visibleLastBlock) {
+        return;
+    }
+
+    m_activeFirstBlock = p_firstBlock;
+    m_activeLastBlock = p_lastBlock;
+    m_visibleFirstBlock = p_visibleFirstBlock;
+    m_visibleLastBlock = p_visibleLastBlock;
+
+    for (int handle : m_activeHandles) {
+        if (handle < m_entries.size()) {
+            m_entries[handle].m_active = false;
+        }
+    }
+
+    m_activeHandles.clear();
+
+    ++m_useClock;
+    if (p_firstBlock > -1) {
+        for (int i = lowerBound(p_firstBlock); i < m_blocksInfo.size(); ++i) {
+            const VBlockImageInfo2 &info = m_blocksInfo[i];
+            if (info.m_blockNumber > p_lastBlock) {
+                break;
+            }
+
+            updateEvictionOrder(info.m_imageHandle, m_useClock);
+            ImageEntry &entry = m_entries[info.m_imageHandle];
+            if (!entry.m_active) {
+                entry.m_active = true;
+                m_activeHandles.append(info.m_imageHandle);
+            }
+        }
+    }
+
+    // Animated images out of the viewport are paused.
+    m_animatedHandles.clear();
+    if (p_visibleFirstBlock > -1) {
+        for (int i = lowerBound(p_visibleFirstBlock); i < m_blocksInfo.size(); ++i) {
+            const VBlockImageInfo2 &info = m_blocksInfo[i];
+            if (info.m_blockNumber > p_visibleLastBlock) {
+                break;
+            }
+
+            if (m_entries[info.m_imageHandle].m_animation
+                && !m_animatedHandles.contains(info.m_imageHandle)) {
+                m_animatedHandles.append(info.m_imageHandle);
+            }
+        }
+    }
+
+    // Loading may find the image in the store at once and change the layout,
+    // which should not happen while painting.
+    if (!m_reloadPending) {
+        m_reloadPending = true;
+        QMetaObject::invokeMethod(this, "reloadActiveImages", Qt::QueuedConnection);
+    }
+
+    evictImages();
+
+    scheduleAnimations();
+}
+
+void VImageResourceManager2::reloadActiveImages()
+{
+    m_reloadPending = false;
+    for (int handle : m_activeHandles) {
+        if (!isValidHandle(handle)) {
+            continue;
+        }
+
+        const ImageEntry &entry = m_entries[handle];
+        if (entry.m_image.isNull() && entry.m_serial == 0 && entry.hasSource()) {
+            // Evicted before. Load it again.
+            loadImage(handle);
+        }
+    }
+
+    evictImages();
+}
+
+void VImageResourceManager2::updateEvictionOrder(int p_handle, quint64 p_lastUse)
+{
+    ImageEntry &entry = m_entries[p_handle];
+    if (entry.m_evictable) {
+        m_evictionOrder.remove(entry.m_lastUse, p_handle);
+    }
+
+    entry.m_lastUse = p_lastUse;
+    entry.m_evictable = entry.m_valid && !entry.m_image.isNull() && entry.hasSource();
+    if (entry.m_evictable) {
+        m_evictionOrder.insert(entry.m_lastUse, p_handle);
+    }
+}
+
+void VImageResourceManager2::evictImages()
+{
+    while (m_residentImageBytes > m_imageMemoryLimit) {
+        // Find the least recently used image which is not near the viewport.
+        // Images near the viewport are the most recently used ones, so only a
+        // few of them are skipped.
+        int victim = -1;
+        for (auto it = m_evictionOrder.constBegin(); it != m_evictionOrder.constEnd(); ++it) {
+            if (!m_entries[it.value()].m_active) {
+                victim = it.value();
+                break;
+            }
+        }
+
+        if (victim == -1) {
+            break;
+        }
+
+        // Keep the scaled variants, which have their own limit.
+        setEntryImage(victim, QPixmap());
+        m_entries[victim].m_nextFrame = QImage();
+    }
+}
+
+void VImageResourceManager2::evictScaledImages()
+{
+    while (m_scaledImageBytes > m_scaledImageLimit) {
+        int victimHandle = -1, victimIdx = -1;
+        quint64 oldest = 0;
+        for (int i = 0; i < m_entries.size(); ++i) {
+            const auto &scaledImages = m_entries[i].m_scaledImages;
+            for (int j = 0; j < scaledImages.size(); ++j) {
+                const ScaledImage &scaled = scaledImages[j];
+                if (scaled.m_image.isNull()) {
+                    continue;
+                }
+
+                if (victimHandle == -1 || scaled.m_lastUse < oldest) {
+                    victimHandle = i;
+                    victimIdx = j;
+                    oldest = scaled.m_lastUse;
+                }
+            }
+        }
+
+        if (victimHandle == -1) {
+            break;
+        }
+
+        auto &scaledImages = m_entries[victimHandle].m_scaledImages;
+        releaseScaledImage(victimHandle, scaledImages[victimIdx]);
+        scaledImages.remove(victimIdx);
+    }
+}
+
+QVector<int> VImageResourceManager2::updateBlockInfos(const QVector<VBlockImageInfo2> &p_blocksInfo)
+{
+    V_TRACE_SPAN("updateBlockInfos");
 
-    for (auto const & info : p_blocksInfo) {
-        auto it = m_blocksInfo.insert(info.m_blockNumber, info);
-        VBlockImageInfo2 &newInfo = it.value();
+    QVector<int> changedBlocks;
+    QVector<VBlockImageInfo2> oldBlocksInfo;
+    oldBlocksInfo.swap(m_blocksInfo);
+
+    // Sort by block number. The latter one wins for the same block.
+    QMap<int, int> order;
+    for (int i = 0; i < p_blocksInfo.size(); ++i) {
+        order.insert(p_blocksInfo[i].m_blockNumber, i);
+    }
+
+    for (auto & entry : m_entries) {
+        entry.m_refs = 0;
+    }
+
+    m_blocksInfo.reserve(order.size());
+    for (int idx : order) {
+        m_blocksInfo.append(p_blocksInfo[idx]);
+        VBlockImageInfo2 &newInfo = m_blocksInfo.last();
         if (newInfo.m_padding < 0) {
             newInfo.m_padding = 0;
         }
 
-        auto imageIt = m_images.find(newInfo.m_imageName);
-        if (imageIt != m_images.end()) {
-            // Fill the width and height.
-            newInfo.m_imageSize = imageIt.value().size();
-            usedImages.insert(newInfo.m_imageName);
+        fillImageInfo(newInfo);
+        ++m_entries[newInfo.m_imageHandle].m_refs;
+    }
+
+    // Diff against the old infos, both sorted by block number.
+    int oldIdx = 0;
+    for (auto const & info : m_blocksInfo) {
+        while (oldIdx < oldBlocksInfo.size()
+               && oldBlocksInfo[oldIdx].m_blockNumber < info.m_blockNumber) {
+            if (!isSameGeometry(&oldBlocksInfo[oldIdx], NULL)) {
+                changedBlocks.append(oldBlocksInfo[oldIdx].m_blockNumber);
+            }
+
+            ++oldIdx;
+        }
+
+        if (oldIdx < oldBlocksInfo.size()
+            && oldBlocksInfo[oldIdx].m_blockNumber == info.m_blockNumber) {
+            if (!isSameGeometry(&oldBlocksInfo[oldIdx], &info)) {
+                changedBlocks.append(info.m_blockNumber);
+            }
+
+            ++oldIdx;
+        } else if (!isSameGeometry(NULL, &info)) {
+            changedBlocks.append(info.m_blockNumber);
+        }
+    }
+
+    for (; oldIdx < oldBlocksInfo.size(); ++oldIdx) {
+        if (!isSameGeometry(&oldBlocksInfo[oldIdx], NULL)) {
+            changedBlocks.append(oldBlocksInfo[oldIdx].m_blockNumber);
         }
     }
 
+    // Block numbers may be changed.
+    m_activeFirstBlock = m_activeLastBlock = -1;
+
     // Clear unused images.
-    for (auto it = m_images.begin(); it != m_images.end();) {
-        if (!usedImages.contains(it.key())) {
-            // Remove the image.
-            it = m_images.erase(it);
+    for (int i = 0; i < m_entries.size(); ++i) {
+        if (m_entries[i].m_valid && m_entries[i].m_refs == 0) {
+            freeEntry(i);
+        }
+    }
+
+    return changedBlocks;
+}
+
+bool VImageResourceManager2::setBlockInfo(const VBlockImageInfo2 &p_info)
+{
+    VBlockImageInfo2 newInfo(p_info);
+    if (newInfo.m_padding < 0) {
+        newInfo.m_padding = 0;
+    }
+
+    fillImageInfo(newInfo);
+    ++m_entries[newInfo.m_imageHandle].m_refs;
+
+    bool changed = false;
+    int idx = lowerBound(newInfo.m_blockNumber);
+    if (idx == m_blocksInfo.size() || m_blocksInfo[idx].m_blockNumber != newInfo.m_blockNumber) {
+        changed = !isSameGeometry(NULL, &newInfo);
+        m_blocksInfo.insert(idx, newInfo);
+    } else {
+        VBlockImageInfo2 &info = m_blocksInfo[idx];
+        changed = !isSameGeometry(&info, &newInfo);
+        int oldHandle = info.m_imageHandle;
+        info = newInfo;
+        releaseImage(oldHandle);
+    }
+
+    if (newInfo.m_blockNumber >= m_activeFirstBlock
+        && newInfo.m_blockNumber <= m_activeLastBlock) {
+        // Refresh the active images on next paint.
+        m_activeFirstBlock = m_activeLastBlock = -1;
+    }
+
+    return changed;
+}
+
+bool VImageResourceManager2::removeBlockInfo(int p_blockNumber)
+{
+    int idx = lowerBound(p_blockNumber);
+    if (idx == m_blocksInfo.size() || m_blocksInfo[idx].m_blockNumber != p_blockNumber) {
+        return false;
+    }
+
+    bool changed = !isSameGeometry(&m_blocksInfo[idx], NULL);
+    int handle = m_blocksInfo[idx].m_imageHandle;
+    m_blocksInfo.remove(idx);
+    releaseImage(handle);
+    return changed;
+}
+
+void VImageResourceManager2::shiftBlockInfos(int p_changeStartBlock,
+                                             int p_oldChangeEndBlock,
+                                             int p_blockCountDelta)
+{
+    // Infos of blocks within the change except the start block are dropped.
+    int first = lowerBound(p_changeStartBlock + 1);
+    int last = lowerBound(p_oldChangeEndBlock + 1);
+    if (first < last) {
+        QVector<int> handles;
+        handles.reserve(last - first);
+        for (int i = first; i < last; ++i) {
+            handles.append(m_blocksInfo[i].m_imageHandle);
+        }
+
+        m_blocksInfo.remove(first, last - first);
+        for (int handle : handles) {
+            releaseImage(handle);
+        }
+    }
+
+    if (p_blockCountDelta != 0) {
+        for (int i = first; i < m_blocksInfo.size(); ++i) {
+            m_blocksInfo[i].m_blockNumber += p_blockCountDelta;
+        }
+    }
+
+    if (p_oldChangeEndBlock >= m_activeFirstBlock) {
+        m_activeFirstBlock = m_activeLastBlock = -1;
+    }
+}
+
+int VImageResourceManager2::lowerBound(int p_blockNumber) const
+{
+    int lo = 0, hi = m_blocksInfo.size();
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (m_blocksInfo[mid].m_blockNumber < p_blockNumber) {
+            lo = mid + 1;
         } else {
-            ++it;
+            hi = mid;
         }
     }
+
+    return lo;
+}
+
+void VImageResourceManager2::fillImageInfo(VBlockImageInfo2 &p_info)
+{
+    p_info.m_imageHandle = internImage(p_info.m_imageName);
+
+    const ImageEntry &entry = m_entries[p_info.m_imageHandle];
+    if (!entry.m_image.isNull() || entry.hasSource()) {
+        // Fill the width and height, which are kept even if being decoded or
+        // evicted.
+        p_info.m_imageSize = entry.m_size;
+    } else {
+        // Reserve space for the image to be added.
+        p_info.m_imageSize = p_info.m_declaredSize;
+    }
+}
+
+bool VImageResourceManager2::isSameGeometry(const VBlockImageInfo2 *p_a, const VBlockImageInfo2 *p_b)
+{
+    bool aHasImage = p_a && !p_a->m_imageSize.isNull();
+    bool bHasImage = p_b && !p_b->m_imageSize.isNull();
+    if (!aHasImage || !bHasImage) {
+        return aHasImage == bHasImage;
+    }
+
+    return p_a->m_imageSize == p_b->m_imageSize
+           && p_a->m_padding == p_b->m_padding;
+}
+
+void VImageResourceManager2::releaseImage(int p_handle)
+{
+    if (!isValidHandle(p_handle)) {
+        return;
+    }
+
+    if (--m_entries[p_handle].m_refs <= 0) {
+        freeEntry(p_handle);
+    }
 }
 
 const VBlockImageInfo2 *VImageResourceManager2::findImageInfoByBlock(int p_blockNumber) const
 {
-    auto it = m_blocksInfo.find(p_blockNumber);
-    if (it != m_blocksInfo.end()) {
-        return &it.value();
+    int idx = lowerBound(p_blockNumber);
+    if (idx < m_blocksInfo.size() && m_blocksInfo[idx].m_blockNumber == p_blockNumber) {
+        return &m_blocksInfo[idx];
     }
 
     return NULL;
@@ -63,16 +1297,232 @@ const VBlockImageInfo2 *VImageResourceManager2::findImageInfoByBlock(int p_block
 
 const QPixmap *VImageResourceManager2::findImage(const QString &p_name) const
 {
-    auto it = m_images.find(p_name);
-    if (it != m_images.end()) {
-        return &it.value();
+    return findImage(findHandle(p_name));
+}
+
+const QPixmap *VImageResourceManager2::findImage(int p_handle) const
+{
+    if (!isValidHandle(p_handle) || m_entries[p_handle].m_image.isNull()) {
+        return NULL;
+    }
+
+    return &m_entries[p_handle].m_image;
+}
+
+const QPixmap *VImageResourceManager2::findImage(int p_handle, int p_minimumWidth) const
+{
+    const QPixmap *image = findImage(p_handle);
+    if (!image) {
+        return NULL;
+    }
+
+    for (auto const & level : m_entries[p_handle].m_mipmaps) {
+        if (level.width() < p_minimumWidth) {
+            break;
+        }
+
+        image = &level;
+    }
+
+    return image;
+}
+
+bool VImageResourceManager2::isAnimatedImage(int p_handle) const
+{
+    return isValidHandle(p_handle) && m_entries[p_handle].m_animation;
+}
+
+const QPixmap *VImageResourceManager2::findScaledImage(int p_handle,
+                                                       const QSize &p_size,
+                                                       qreal p_devicePixelRatio)
+{
+    QSize pixelSize = p_size * p_devicePixelRatio;
+    // Scale from the nearest level.
+    const QPixmap *image = findImage(p_handle, pixelSize.width());
+    if (!image) {
+        return NULL;
+    }
+
+    if (pixelSize.width() >= image->width() || pixelSize.isEmpty()) {
+        // No need to scale down.
+        return image;
     }
 
+    if (!isScaledImageCacheable(p_size, p_devicePixelRatio)) {
+        // It would be evicted right after being scaled.
+        return NULL;
+    }
+
+    auto &scaledImages = m_entries[p_handle].m_scaledImages;
+    for (auto & scaled : scaledImages) {
+        if (scaled.m_size == p_size && scaled.m_devicePixelRatio == p_devicePixelRatio) {
+            if (scaled.m_image.isNull()) {
+                // Being scaled.
+                return NULL;
+            }
+
+            scaled.m_lastUse = ++m_scaledUseClock;
+            return &scaled.m_image;
+        }
+    }
+
+    ScaledImage scaled;
+    scaled.m_size = p_size;
+    scaled.m_devicePixelRatio = p_devicePixelRatio;
+
+    // Another editor may have scaled it already.
+    QByteArray key = scaledImageKey(p_handle, p_size, p_devicePixelRatio);
+    VImageStore::Image shared;
+    if (!key.isEmpty() && VImageStore::instance().acquire(key, shared)) {
+        scaled.m_image = shared.m_image;
+        scaled.m_lastUse = ++m_scaledUseClock;
+        m_scaledImageBytes += imageBytes(scaled.m_image);
+        scaledImages.append(scaled);
+        return &scaledImages.last().m_image;
+    }
+
+    scaledImages.append(scaled);
+
+    m_workerPool.start(new VImageScaleTask(this,
+                                           p_handle,
+                                           image->cacheKey(),
+                                           image->toImage(),
+                                           p_size,
+                                           p_devicePixelRatio));
     return NULL;
 }
 
+bool VImageResourceManager2::isScaledImageCacheable(const QSize &p_size,
+                                                    qreal p_devicePixelRatio) const
+{
+    QSize pixelSize = p_size * p_devicePixelRatio;
+    return (qint64)pixelSize.width() * pixelSize.height() * 4 <= m_scaledImageLimit;
+}
+
+void VImageResourceManager2::handleScaledImage(int p_handle,
+                                               qint64 p_sourceKey,
+                                               const QSize &p_size,
+                                               double p_devicePixelRatio,
+                                               const QImage &p_image)
+{
+    bool sourceFound = false;
+    if (isValidHandle(p_handle)) {
+        const ImageEntry &entry = m_entries[p_handle];
+        sourceFound = !entry.m_image.isNull() && entry.m_image.cacheKey() == p_sourceKey;
+        for (auto const & level : entry.m_mipmaps) {
+            if (level.cacheKey() == p_sourceKey) {
+                sourceFound = true;
+            }
+        }
+    }
+
+    if (!sourceFound) {
+        // The image has been changed or evicted since.
+        if (isValidHandle(p_handle)) {
+            auto &scaledImages = m_entries[p_handle].m_scaledImages;
+            for (int i = 0; i < scaledImages.size(); ++i) {
+                const ScaledImage &scaled = scaledImages[i];
+                if (scaled.m_image.isNull()
+                    && scaled.m_size == p_size
+                    && scaled.m_devicePixelRatio == p_devicePixelRatio) {
+                    scaledImages.remove(i);
+                    break;
+                }
+            }
+        }
+
+        return;
+    }
+
+    ImageEntry &entry = m_entries[p_handle];
+    for (auto & scaled : entry.m_scaledImages) {
+        if (scaled.m_image.isNull()
+            && scaled.m_size == p_size
+            && scaled.m_devicePixelRatio == p_devicePixelRatio) {
+            VImageStore::Image shared;
+            shared.m_image = QPixmap::fromImage(p_image);
+            QByteArray key = scaledImageKey(p_handle, p_size, p_devicePixelRatio);
+            if (!key.isEmpty()) {
+                // Share it with other editors.
+                shared = VImageStore::instance().insert(key, shared);
+            }
+
+            scaled.m_image = shared.m_image;
+            scaled.m_lastUse = ++m_scaledUseClock;
+            m_scaledImageBytes += imageBytes(scaled.m_image);
+
+            QString name = entry.m_name;
+            evictScaledImages();
+            emit imageUpdated(name);
+            return;
+        }
+    }
+}
+
+void VImageResourceManager2::setScaledImageCacheLimit(int p_bytes)
+{
+    m_scaledImageLimit = qMax(p_bytes, 0);
+    evictScaledImages();
+}
+
+void VImageResourceManager2::removeScaledImages(int p_handle)
+{
+    auto &scaledImages = m_entries[p_handle].m_scaledImages;
+    for (auto const & scaled : scaledImages) {
+        releaseScaledImage(p_handle, scaled);
+    }
+
+    scaledImages.clear();
+}
+
+void VImageResourceManager2::releaseScaledImage(int p_handle, const ScaledImage &p_scaled)
+{
+    if (p_scaled.m_image.isNull()) {
+        return;
+    }
+
+    m_scaledImageBytes -= imageBytes(p_scaled.m_image);
+
+    QByteArray key = scaledImageKey(p_handle, p_scaled.m_size, p_scaled.m_devicePixelRatio);
+    if (!key.isEmpty()) {
+        VImageStore::instance().release(key);
+    }
+}
+
+QByteArray VImageResourceManager2::scaledImageKey(int p_handle,
+                                                  const QSize &p_size,
+                                                  qreal p_devicePixelRatio) const
+{
+    const QByteArray &contentKey = m_entries[p_handle].m_contentKey;
+    if (contentKey.isEmpty()) {
+        return QByteArray();
+    }
+
+    return contentKey
+           + '@' + QByteArray::number(p_size.width())
+           + 'x' + QByteArray::number(p_size.height())
+           + '@' + QByteArray::number(p_devicePixelRatio);
+}
+
 void VImageResourceManager2::clear()
 {
+    // Release the images shared via the store.
+    for (int i = 0; i < m_entries.size(); ++i) {
+        if (m_entries[i].m_valid) {
+            freeEntry(i);
+        }
+    }
+
     m_blocksInfo.clear();
-    m_images.clear();
+    m_entries.clear();
+    m_freeHandles.clear();
+    m_handles.clear();
+    m_evictionOrder.clear();
+    m_activeHandles.clear();
+    m_activeFirstBlock = m_activeLastBlock = -1;
+    m_visibleFirstBlock = m_visibleLastBlock = -1;
+    m_animatedHandles.clear();
+    m_animationTimer.stop();
+    m_residentImageBytes = 0;
+    m_scaledImageBytes = 0;
 }
@@ -1,43 +1,413 @@
 #ifndef VIMAGERESOURCEMANAGER2_H
 #define VIMAGERESOURCEMANAGER2_H
 
+#include <QObject>
 #include <QHash>
+#include <QMap>
 #include <QString>
+#include <QByteArray>
 #include <QPixmap>
+#include <QImage>
+#include <QSize>
 #include <QTextBlock>
 #include <QVector>
+#include <QThreadPool>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QSharedPointer>
 
 struct VBlockImageInfo2;
+class VImageAnimation;
 
 
-class VImageResourceManager2
+// Images are interned as integer handles indexing a dense table of entries.
+// The handle of each block image is kept in its VBlockImageInfo2, so the paint
+// and layout paths do not look images up by name.
+class VImageResourceManager2 : public QObject
 {
+    Q_OBJECT
 public:
-    VImageResourceManager2();
+    explicit VImageResourceManager2(QObject *p_parent = nullptr);
+
+    ~VImageResourceManager2();
 
     // Add an image to the resource with @p_name as the key.
     // If @p_name already exists in the resources, it will update it.
     void addImage(const QString &p_name, const QPixmap &p_image);
 
+    // Add an image to be decoded from file @p_filePath in the background.
+    // The size is read from the header at once so the layout could be done
+    // before the image is decoded.
+    // imageSizeChanged() or imageUpdated() will be emitted once it is decoded.
+    // Animated images, such as GIF, are played while their blocks are visible.
+    // Return false if the image could not be read.
+    bool addImageFromFile(const QString &p_name, const QString &p_filePath);
+
+    // Add an image to be decoded from data @p_data in the background.
+    bool addImageFromData(const QString &p_name, const QByteArray &p_data);
+
+    // Add an image to be decoded from data URL @p_dataUrl in the background,
+    // such as "data:image/png;base64,...".
+    bool addImageFromDataUrl(const QString &p_name, const QString &p_dataUrl);
+
     // Whether the resources contains image with name @p_name.
+    // Images being decoded are included.
     bool contains(const QString &p_name) const;
 
     // Update the block-image info for all blocks.
-    // @p_maximumWidth: maximum width of the images plus the margin.
-    void updateBlockInfos(const QVector<VBlockImageInfo2> &p_blocksInfo);
+    // Return the numbers of blocks whose geometry changed.
+    QVector<int> updateBlockInfos(const QVector<VBlockImageInfo2> &p_blocksInfo);
+
+    // Insert or update the block-image info of one block.
+    // Return true if the geometry of the block changed.
+    bool setBlockInfo(const VBlockImageInfo2 &p_info);
+
+    // Remove the block-image info of block @p_blockNumber.
+    // Return true if the geometry of the block changed.
+    bool removeBlockInfo(int p_blockNumber);
+
+    // Keep the infos attached to their blocks after the document changed.
+    // Blocks (@p_changeStartBlock, @p_oldChangeEndBlock] in the old document
+    // are replaced and their infos are dropped. Infos after them are shifted
+    // by @p_blockCountDelta.
+    void shiftBlockInfos(int p_changeStartBlock,
+                         int p_oldChangeEndBlock,
+                         int p_blockCountDelta);
 
     const VBlockImageInfo2 *findImageInfoByBlock(int p_blockNumber) const;
 
+    // Return NULL if image @p_name does not exist or is being decoded.
     const QPixmap *findImage(const QString &p_name) const;
 
+    // Find image by handle, such as the one of VBlockImageInfo2.
+    const QPixmap *findImage(int p_handle) const;
+
+    // Find the smallest level of image @p_handle not narrower than
+    // @p_minimumWidth in pixels, or the largest one if none.
+    const QPixmap *findImage(int p_handle, int p_minimumWidth) const;
+
+    // Whether image @p_handle is animated, whose frame changes over time.
+    bool isAnimatedImage(int p_handle) const;
+
+    // Return the numbers of blocks with image @p_name.
+    QVector<int> findBlocksByImage(const QString &p_name) const;
+
+    // Find the variant of image @p_handle scaled to @p_size at device pixel
+    // ratio @p_devicePixelRatio.
+    // Return the image itself if it does not need to be scaled down.
+    // Return NULL if the variant is not ready yet, in which case it will be
+    // scaled smoothly in a worker thread and imageUpdated() will be emitted
+    // once it is ready.
+    const QPixmap *findScaledImage(int p_handle,
+                                   const QSize &p_size,
+                                   qreal p_devicePixelRatio);
+
+    // Whether a variant scaled to @p_size at device pixel ratio
+    // @p_devicePixelRatio fits in the memory limit of scaled variants.
+    // findScaledImage() never scales the ones not fitting.
+    bool isScaledImageCacheable(const QSize &p_size, qreal p_devicePixelRatio) const;
+
+    // Memory limit of the scaled variants of images.
+    void setScaledImageCacheLimit(int p_bytes);
+
+    // Decode images from files or data at most @p_width pixels wide, keeping
+    // the aspect ratio, plus a few halved levels for smaller zoom levels.
+    // Sizes reported to the layout are still the original ones.
+    // 0 to decode at the original size, which is the default.
+    // Images decoded already are not affected.
+    void setMaximumDecodeWidth(int p_width);
+
+    // Memory limit of the decoded images.
+    // Images decoded from files or data are evicted to their sources when
+    // beyond the limit and decoded again when they are needed. Their sizes
+    // are kept so the layout will not change.
+    // Images added as QPixmap could not be evicted.
+    void setImageMemoryLimit(qint64 p_bytes);
+
+    // Bytes of decoded images.
+    qint64 residentImageBytes() const;
+
+    // Set the range of blocks near the viewport, whose images should be kept
+    // decoded. Evicted images in the range will be decoded again, starting
+    // from the event loop so that no signal is emitted within this call,
+    // which is made while painting.
+    // Animated images of blocks in [@p_visibleFirstBlock, @p_visibleLastBlock],
+    // the ones inside the viewport, are played. Others are paused.
+    void setActiveBlockRange(int p_firstBlock,
+                             int p_lastBlock,
+                             int p_visibleFirstBlock = -1,
+                             int p_visibleLastBlock = -1);
+
     void clear();
 
+signals:
+    // Emitted when something to draw of image @p_name is ready.
+    void imageUpdated(const QString &p_name);
+
+    // Emitted when image @p_name is decoded with a size different from the one
+    // of the header. Blocks with it need to be laid out again.
+    void imageSizeChanged(const QString &p_name);
+
+    // Emitted when animated image @p_name advanced to a new frame of the same
+    // size. Only the image area of blocks with it needs to be repainted.
+    void imageFrameChanged(const QString &p_name);
+
+private slots:
+    void handleScaledImage(int p_handle,
+                           qint64 p_sourceKey,
+                           const QSize &p_size,
+                           double p_devicePixelRatio,
+                           const QImage &p_image);
+
+    // @p_contentKey is empty if failed to read the content.
+    void handleHashedImage(int p_handle, int p_serial, const QByteArray &p_contentKey);
+
+    void handleDecodedImage(int p_handle,
+                            int p_serial,
+                            const QSize &p_originalSize,
+                            const QImage &p_image,
+                            const QVector<QImage> &p_mipmaps,
+                            bool p_animated,
+                            int p_delay);
+
+    // @p_frame is null if failed to read.
+    // @p_delay: delay in ms to show @p_frame.
+    void handleAnimationFrame(int p_handle, int p_serial, const QImage &p_frame, int p_delay);
+
+    // Advance the animated images in the visible range whose frames are due.
+    void advanceAnimations();
+
+    // Load the evicted images used by blocks in the active range.
+    void reloadActiveImages();
+
 private:
-    // All the images resources.
-    QHash<QString, QPixmap> m_images;
+    struct ScaledImage
+    {
+        ScaledImage()
+            : m_devicePixelRatio(1),
+              m_lastUse(0)
+        {
+        }
+
+        // Size in device independent pixels.
+        QSize m_size;
+
+        qreal m_devicePixelRatio;
+
+        // Null while being scaled.
+        QPixmap m_image;
+
+        quint64 m_lastUse;
+    };
+
+    // Metadata of an image.
+    struct ImageEntry
+    {
+        ImageEntry()
+            : m_valid(false),
+              m_decodeWidth(0),
+              m_contentHashed(false),
+              m_serial(0),
+              m_refs(0),
+              m_lastUse(0),
+              m_evictable(false),
+              m_active(false),
+              m_nextFrameTime(0),
+              m_nextFrameDelay(0)
+        {
+        }
+
+        bool hasSource() const
+        {
+            return !m_filePath.isEmpty() || !m_data.isEmpty();
+        }
+
+        // Whether this entry is in use.
+        bool m_valid;
+
+        QString m_name;
+
+        // Null if being decoded or evicted.
+        // May be smaller than m_size if decoded at a bounded size.
+        QPixmap m_image;
+
+        // Halved levels of m_image, from the largest.
+        QVector<QPixmap> m_mipmaps;
+
+        // Original size. Kept even if evicted.
+        QSize m_size;
+
+        // Source to decode the image from.
+        QString m_filePath;
+
+        QByteArray m_data;
+
+        // Width to decode at most.
+        int m_decodeWidth;
+
+        // Key in VImageStore. Empty if not shared or not hashed yet.
+        QByteArray m_contentKey;
+
+        // Whether the content has been hashed into m_contentKey.
+        bool m_contentHashed;
+
+        // Serial of the decoding in progress, or 0.
+        int m_serial;
+
+        // Number of blocks using this image.
+        int m_refs;
+
+        // Last use in terms of m_useClock.
+        quint64 m_lastUse;
+
+        // Whether in m_evictionOrder.
+        bool m_evictable;
+
+        // Whether used by blocks in the active range.
+        bool m_active;
+
+        QVector<ScaledImage> m_scaledImages;
+
+        // Frames of an animated image. Null if not animated.
+        QSharedPointer<VImageAnimation> m_animation;
+
+        // Next frame read ahead, or null if being read.
+        QImage m_nextFrame;
+
+        // Time in terms of m_animationClock to show m_nextFrame.
+        qint64 m_nextFrameTime;
+
+        // Delay in ms to show m_nextFrame.
+        int m_nextFrameDelay;
+    };
+
+    // Return the handle of image @p_name, creating one if not exists.
+    int internImage(const QString &p_name);
+
+    // Return -1 if not exists.
+    int findHandle(const QString &p_name) const;
+
+    bool isValidHandle(int p_handle) const;
+
+    void freeEntry(int p_handle);
+
+    // Set the decoded image and its levels of entry @p_handle, which could be null.
+    void setEntryImage(int p_handle,
+                       const QPixmap &p_image,
+                       const QVector<QPixmap> &p_mipmaps = QVector<QPixmap>());
+
+    // Read the header of image @p_name from file @p_filePath or data @p_data
+    // and start decoding it.
+    bool decodeImage(const QString &p_name,
+                     const QString &p_filePath,
+                     const QByteArray &p_data);
+
+    // Load image @p_handle from the shared store, or start decoding it from
+    // its source. Start hashing its content first if not yet.
+    void loadImage(int p_handle);
+
+    // Start reading the next frame of animated image @p_handle in the
+    // decoding threads.
+    void readNextFrame(int p_handle);
+
+    // Start the animation timer for the earliest frame due.
+    void scheduleAnimations();
+
+    // Key in VImageStore of a scaled variant of image @p_handle.
+    QByteArray scaledImageKey(int p_handle, const QSize &p_size, qreal p_devicePixelRatio) const;
+
+    // Fill the image handle and size of @p_info.
+    void fillImageInfo(VBlockImageInfo2 &p_info);
+
+    // Whether blocks with @p_a and @p_b have the same geometry.
+    // NULL for a block without image.
+    static bool isSameGeometry(const VBlockImageInfo2 *p_a, const VBlockImageInfo2 *p_b);
+
+    // Release one reference of image @p_handle. Remove it if not used any more.
+    void releaseImage(int p_handle);
+
+    // Drop all the scaled variants of image @p_handle.
+    void removeScaledImages(int p_handle);
+
+    // Release the memory and the shared reference of @p_scaled of image @p_handle.
+    void releaseScaledImage(int p_handle, const ScaledImage &p_scaled);
+
+    // Update the image size of all the blocks with image @p_handle.
+    // Return true if the geometry of any block changed.
+    bool updateBlockImageSize(int p_handle, const QSize &p_size);
+
+    // Set the last use of image @p_handle and keep m_evictionOrder in sync.
+    void updateEvictionOrder(int p_handle, quint64 p_lastUse);
+
+    // Evict least recently used images until within the memory limit.
+    void evictImages();
+
+    // Evict least recently used scaled variants until within the memory limit.
+    void evictScaledImages();
+
+    // Index of the first info in m_blocksInfo with block number not less
+    // than @p_blockNumber.
+    int lowerBound(int p_blockNumber) const;
+
+    // Image info of all the blocks with image, sorted by block number.
+    QVector<VBlockImageInfo2> m_blocksInfo;
+
+    // Image entries indexed by handle.
+    QVector<ImageEntry> m_entries;
+
+    // Handles of freed entries to reuse.
+    QVector<int> m_freeHandles;
+
+    // Image name to handle.
+    QHash<QString, int> m_handles;
+
+    int m_decodeSerial;
+
+    quint64 m_useClock;
+
+    // Handles of images which could be evicted, i.e. decoded ones with a
+    // source to decode them again, by their last use.
+    QMultiMap<quint64, int> m_evictionOrder;
+
+    quint64 m_scaledUseClock;
+
+    // Handles of images used by blocks in the active range.
+    QVector<int> m_activeHandles;
+
+    int m_activeFirstBlock;
+
+    int m_activeLastBlock;
+
+    int m_visibleFirstBlock;
+
+    int m_visibleLastBlock;
+
+    // Whether reloadActiveImages() is queued.
+    bool m_reloadPending;
+
+    // Handles of animated images used by blocks in the visible range.
+    QVector<int> m_animatedHandles;
+
+    // One timer drives all the animated images.
+    QTimer m_animationTimer;
+
+    QElapsedTimer m_animationClock;
+
+    qint64 m_imageMemoryLimit;
+
+    qint64 m_residentImageBytes;
+
+    qint64 m_scaledImageLimit;
+
+    qint64 m_scaledImageBytes;
+
+    int m_maximumDecodeWidth;
+
+    // Worker thread to scale images.
+    QThreadPool m_workerPool;
 
-    // Image info of all the blocks with image.
-    QHash<int, VBlockImageInfo2> m_blocksInfo;
+    // Threads to decode images.
+    QThreadPool m_decodePool;
 };
 
 #endif // VIMAGERESOURCEMANAGER2_H
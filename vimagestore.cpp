@@ -0,0 +1,75 @@
+#include "vimagestore.h"
+
+#include <QCryptographicHash>
+#include <QFile>
+
+
+VImageStore &VImageStore::instance()
+{
+    static VImageStore store;
+    return store;
+}
+
+VImageStore::VImageStore()
+{
+}
+
+QByteArray VImageStore::contentKey(const QByteArray &p_data)
+{
+    return QCryptographicHash::hash(p_data, QCryptographicHash::Sha1);
+}
+
+QByteArray VImageStore::fileContentKey(const QString &p_filePath)
+{
+    QFile file(p_filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!hash.addData(&file)) {
+        return QByteArray();
+    }
+
+    return hash.result();
+}
+
+bool VImageStore::acquire(const QByteArray &p_key, Image &p_image)
+{
+    auto it = m_entries.find(p_key);
+    if (it == m_entries.end()) {
+        return false;
+    }
+
+    ++it.value().m_refs;
+    p_image = it.value().m_image;
+    return true;
+}
+
+VImageStore::Image VImageStore::insert(const QByteArray &p_key, const Image &p_image)
+{
+    Entry &entry = m_entries[p_key];
+    if (entry.m_refs == 0) {
+        entry.m_image = p_image;
+    }
+
+    ++entry.m_refs;
+    return entry.m_image;
+}
+
+void VImageStore::release(const QByteArray &p_key)
+{
+    auto it = m_entries.find(p_key);
+    if (it == m_entries.end()) {
+        return;
+    }
+
+    if (--it.value().m_refs <= 0) {
+        m_entries.erase(it);
+    }
+}
+
+int VImageStore::count() const
+{
+    return m_entries.size();
+}
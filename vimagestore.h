@@ -0,0 +1,74 @@
+#ifndef VIMAGESTORE_H
+#define VIMAGESTORE_H
+
+#include <QHash>
+#include <QByteArray>
+#include <QPixmap>
+#include <QVector>
+#include <QSize>
+
+
+// A process-wide store of decoded images shared by all the VImageResourceManager2,
+// deduplicated by a key derived from the content of the images.
+// Each image is reference counted by the managers holding it and dropped from
+// the store once released by all of them. Pixmaps are implicitly shared, so
+// managers holding the same image hold only one copy in memory.
+// Should be used in the GUI thread only, except the key functions, which are
+// called by the decoding threads.
+class VImageStore
+{
+public:
+    struct Image
+    {
+        QPixmap m_image;
+
+        // Halved levels of m_image.
+        QVector<QPixmap> m_mipmaps;
+
+        // Original size.
+        QSize m_size;
+    };
+
+    static VImageStore &instance();
+
+    // Compute the content key of encoded image data @p_data.
+    static QByteArray contentKey(const QByteArray &p_data);
+
+    // Compute the content key of image file @p_filePath.
+    // Return an empty key if failed to read the file.
+    static QByteArray fileContentKey(const QString &p_filePath);
+
+    // Find image @p_key and acquire one reference of it.
+    // Return false if not exists.
+    bool acquire(const QByteArray &p_key, Image &p_image);
+
+    // Insert image @p_key and acquire one reference of it.
+    // Return the image in the store, which is the existing one if @p_key
+    // already exists.
+    Image insert(const QByteArray &p_key, const Image &p_image);
+
+    // Release one reference of image @p_key.
+    void release(const QByteArray &p_key);
+
+    // Number of images in the store.
+    int count() const;
+
+private:
+    struct Entry
+    {
+        Entry()
+            : m_refs(0)
+        {
+        }
+
+        Image m_image;
+
+        int m_refs;
+    };
+
+    VImageStore();
+
+    QHash<QByteArray, Entry> m_entries;
+};
+
+#endif // VIMAGESTORE_H
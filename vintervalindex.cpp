@@ -0,0 +1,120 @@
+#include "vintervalindex.h"
+
+#include <algorithm>
+
+// Subtrees of this level or below are scanned linearly.
+static const int c_scanLevel = 3;
+
+
+VIntervalIndex::VIntervalIndex()
+    : m_maxLevel(-1)
+{
+}
+
+void VIntervalIndex::clear()
+{
+    m_intervals.clear();
+    m_maxLevel = -1;
+}
+
+void VIntervalIndex::add(int p_start, int p_end, int p_value)
+{
+    Interval interval;
+    interval.m_start = p_start;
+    interval.m_end = p_end;
+    interval.m_max = p_end;
+    interval.m_value = p_value;
+    m_intervals.append(interval);
+}
+
+// Node i of the implicit tree is at the level of the number of trailing 1 bits
+// of i. Leaves are the even indexes. Node i at level k has children
+// i - 2^(k-1) and i + 2^(k-1). Nodes beyond the size are missing, so the
+// maximum end of the last real subtree is carried for them.
+void VIntervalIndex::build()
+{
+    const int n = m_intervals.size();
+    m_maxLevel = -1;
+    if (n == 0) {
+        return;
+    }
+
+    std::sort(m_intervals.begin(), m_intervals.end());
+
+    Interval *a = m_intervals.data();
+    int lastIdx = 0;
+    int last = 0;
+    for (int i = 0; i < n; i += 2) {
+        lastIdx = i;
+        last = a[i].m_max = a[i].m_end;
+    }
+
+    int k = 1;
+    for (; (1 << k) <= n; ++k) {
+        const int x = 1 << (k - 1);
+        const int i0 = (x << 1) - 1;
+        const int step = x << 2;
+        for (int i = i0; i < n; i += step) {
+            int leftMax = a[i - x].m_max;
+            int rightMax = i + x < n ? a[i + x].m_max : last;
+            a[i].m_max = qMax(a[i].m_end, qMax(leftMax, rightMax));
+        }
+
+        lastIdx = ((lastIdx >> k) & 1) ? lastIdx - x : lastIdx + x;
+        if (lastIdx < n && a[lastIdx].m_max > last) {
+            last = a[lastIdx].m_max;
+        }
+    }
+
+    m_maxLevel = k - 1;
+}
+
+void VIntervalIndex::overlap(int p_start, int p_end, QVector<int> &p_values) const
+{
+    if (m_maxLevel < 0) {
+        return;
+    }
+
+    struct Node
+    {
+        int m_idx;
+
+        int m_level;
+
+        // Whether the left subtree has been visited.
+        bool m_leftDone;
+    };
+
+    const int n = m_intervals.size();
+    const Interval *a = m_intervals.constData();
+
+    // Depth is bounded by the level of the root.
+    Node stack[64];
+    int top = 0;
+    stack[top++] = { (1 << m_maxLevel) - 1, m_maxLevel, false };
+    while (top > 0) {
+        Node node = stack[--top];
+        if (node.m_level <= c_scanLevel) {
+            int i0 = node.m_idx >> node.m_level << node.m_level;
+            int i1 = qMin(i0 + (1 << (node.m_level + 1)) - 1, n);
+            for (int i = i0; i < i1 && a[i].m_start < p_end; ++i) {
+                if (p_start < a[i].m_end) {
+                    p_values.append(a[i].m_value);
+                }
+            }
+        } else if (!node.m_leftDone) {
+            int left = node.m_idx - (1 << (node.m_level - 1));
+            node.m_leftDone = true;
+            stack[top++] = node;
+            if (left >= n || a[left].m_max > p_start) {
+                stack[top++] = { left, node.m_level - 1, false };
+            }
+        } else if (node.m_idx < n && a[node.m_idx].m_start < p_end) {
+            if (p_start < a[node.m_idx].m_end) {
+                p_values.append(a[node.m_idx].m_value);
+            }
+
+            stack[top++] = { node.m_idx + (1 << (node.m_level - 1)), node.m_level - 1, false };
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef VINTERVALINDEX_H
+#define VINTERVALINDEX_H
+
+#include <QVector>
+
+
+// A static index over half-open integer intervals [start, end), each with an
+// integer value. Building costs O(m log m). Finding the intervals overlapping
+// a range costs O(log m + k), via an implicit interval tree laid over the
+// intervals sorted by start, where each node keeps the maximum end of its
+// subtree.
+class VIntervalIndex
+{
+public:
+    VIntervalIndex();
+
+    int size() const;
+
+    void clear();
+
+    // Add interval [@p_start, @p_end) with value @p_value.
+    // build() should be called before overlap().
+    void add(int p_start, int p_end, int p_value);
+
+    void build();
+
+    // Append the values of the intervals overlapping [@p_start, @p_end) to
+    // @p_values, in the order of their starts.
+    void overlap(int p_start, int p_end, QVector<int> &p_values) const;
+
+private:
+    struct Interval
+    {
+        bool operator<(const Interval &p_other) const
+        {
+            return m_start < p_other.m_start;
+        }
+
+        int m_start;
+
+        int m_end;
+
+        // Maximum end of the subtree of this node.
+        int m_max;
+
+        int m_value;
+    };
+
+    QVector<Interval> m_intervals;
+
+    // Level of the root of the implicit tree, or -1 if empty.
+    int m_maxLevel;
+};
+
+inline int VIntervalIndex::size() const
+{
+    return m_intervals.size();
+}
+
+#endif // VINTERVALINDEX_H
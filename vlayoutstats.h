@@ -0,0 +1,117 @@
+#ifndef VLAYOUTSTATS_H
+#define VLAYOUTSTATS_H
+
+#include <QtGlobal>
+#include <QElapsedTimer>
+
+
+// Performance counters of VTextDocumentLayout.
+// Define VTEXTEDIT_NO_PERF_STATS to compile all the instrumentation out, in
+// which case all the counters stay 0.
+struct VLayoutStats
+{
+    // Phases with timings.
+    enum Phase
+    {
+        DocumentChanged = 0,
+        LayoutBlock,
+        Draw,
+        DrawBlockImage,
+        PhaseCount
+    };
+
+    VLayoutStats()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        m_blocksLaidOut = 0;
+        m_blocksMeasured = 0;
+        m_blocksDrawn = 0;
+        m_cachedBlocksDrawn = 0;
+        m_imagesDrawn = 0;
+        m_singleBlockRelayouts = 0;
+        m_multiBlockRelayouts = 0;
+        m_onDemandLayouts = 0;
+        m_backgroundLayouts = 0;
+        m_heightUpdates = 0;
+        m_blockShifts = 0;
+
+        for (int i = 0; i < PhaseCount; ++i) {
+            m_phaseNs[i] = 0;
+        }
+    }
+
+    // Number of blocks laid out by QTextLayout on the GUI thread.
+    qint64 m_blocksLaidOut;
+
+    // Number of blocks measured by bulk layout jobs and published.
+    qint64 m_blocksMeasured;
+
+    qint64 m_blocksDrawn;
+
+    // Blocks drawn from the raster cache without re-rendering.
+    qint64 m_cachedBlocksDrawn;
+
+    qint64 m_imagesDrawn;
+
+    // Relayout causes.
+    // Document changes inside one block.
+    qint64 m_singleBlockRelayouts;
+
+    // Document changes across blocks.
+    qint64 m_multiBlockRelayouts;
+
+    // Blocks laid out on demand when drawn or queried.
+    qint64 m_onDemandLayouts;
+
+    // Blocks laid out by background layout.
+    qint64 m_backgroundLayouts;
+
+    // Number of block heights updated in the offset index.
+    qint64 m_heightUpdates;
+
+    // Number of block entries inserted or removed due to block count changes.
+    qint64 m_blockShifts;
+
+    // Accumulated time of each phase in nanoseconds.
+    qint64 m_phaseNs[PhaseCount];
+};
+
+
+// Add the elapsed time of current scope to a phase of VLayoutStats.
+class VLayoutStatsTimer
+{
+public:
+    VLayoutStatsTimer(VLayoutStats &p_stats, VLayoutStats::Phase p_phase)
+        : m_stats(p_stats),
+          m_phase(p_phase)
+    {
+        m_timer.start();
+    }
+
+    ~VLayoutStatsTimer()
+    {
+        m_stats.m_phaseNs[m_phase] += m_timer.nsecsElapsed();
+    }
+
+private:
+    VLayoutStats &m_stats;
+
+    VLayoutStats::Phase m_phase;
+
+    QElapsedTimer m_timer;
+};
+
+
+#ifndef VTEXTEDIT_NO_PERF_STATS
+#define V_STATS_ADD(p_stats, p_field, p_value) ((p_stats).p_field += (p_value))
+#define V_STATS_TIME_SCOPE(p_stats, p_phase) VLayoutStatsTimer vLayoutStatsTimer((p_stats), (p_phase))
+#else
+#define V_STATS_ADD(p_stats, p_field, p_value)
+#define V_STATS_TIME_SCOPE(p_stats, p_phase)
+#endif
+
+#endif // VLAYOUTSTATS_H
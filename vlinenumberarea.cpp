@@ -2,6 +2,11 @@
 
 #include <QPaintEvent>
 #include <QTextDocument>
+#include <QPainter>
+#include <QtMath>
+
+// Maximum number of laid out numbers cached.
+static const int c_maximumCachedTexts = 4096;
 
 VLineNumberArea::VLineNumberArea(VTextEditWithLineNumber *p_editor,
                                  const QTextDocument *p_document,
@@ -15,8 +20,10 @@ VLineNumberArea::VLineNumberArea(VTextEditWithLineNumber *p_editor,
       m_blockCount(-1),
       m_digitWidth(p_digitWidth),
       m_digitHeight(p_digitHeight),
+      m_reservedDigits(0),
       m_foregroundColor("black"),
-      m_backgroundColor("grey")
+      m_backgroundColor("grey"),
+      m_cacheOffset(0)
 {
 }
 
@@ -35,8 +42,181 @@ int VLineNumberArea::calculateWidth() const
         ++digits;
     }
 
+    digits = qMax(digits, m_reservedDigits);
+
     int width = m_digitWidth * (digits + 1);
     const_cast<VLineNumberArea *>(this)->m_width = width;
 
     return m_width;
 }
+
+void VLineNumberArea::setReservedDigits(int p_digits)
+{
+    m_reservedDigits = qMax(p_digits, 0);
+    // Calculate the width again.
+    m_blockCount = -1;
+}
+
+void VLineNumberArea::paintRows(const QRect &p_rect, const QVector<Row> &p_rows, int p_offset)
+{
+    qreal dpr = devicePixelRatioF();
+    QSize pixelSize = size() * dpr;
+    if (m_cache.size() != pixelSize || m_cache.devicePixelRatio() != dpr) {
+        m_cache = QPixmap(pixelSize);
+        m_cache.setDevicePixelRatio(dpr);
+        m_cache.fill(m_backgroundColor);
+        m_rows.clear();
+    } else {
+        scrollCache(p_offset);
+    }
+
+    m_cacheOffset = p_offset;
+
+    QPainter cachePainter(&m_cache);
+    cachePainter.setFont(font());
+
+    // Bands of the cache changed.
+    QRect changed;
+
+    // Clear the rows gone first, since new rows may overlap them.
+    // Both are sorted by top.
+    int idx = 0;
+    for (auto const & row : m_rows) {
+        while (idx < p_rows.size() && p_rows[idx].m_top < row.m_top) {
+            ++idx;
+        }
+
+        if (idx == p_rows.size() || !(p_rows[idx] == row)) {
+            clearRow(&cachePainter, row);
+            changed |= rowRect(row);
+        }
+    }
+
+    idx = 0;
+    for (auto const & row : p_rows) {
+        while (idx < m_rows.size() && m_rows[idx].m_top < row.m_top) {
+            ++idx;
+        }
+
+        if (idx == m_rows.size() || !(m_rows[idx] == row)) {
+            clearRow(&cachePainter, row);
+            drawRow(&cachePainter, row);
+            changed |= rowRect(row);
+        }
+    }
+
+    cachePainter.end();
+    m_rows = p_rows;
+
+    QPainter painter(this);
+    painter.drawPixmap(QRectF(p_rect),
+                       m_cache,
+                       QRectF(p_rect.topLeft() * dpr, p_rect.size() * dpr));
+    painter.end();
+
+    // Rows may change outside @p_rect, such as those shifted by a relayout
+    // while only one row is updated. They are in the cache but not on the
+    // screen yet, and will not differ in later paints.
+    if (!changed.isEmpty() && !p_rect.contains(changed)) {
+        update(changed);
+    }
+}
+
+void VLineNumberArea::invalidateCache()
+{
+    m_cache = QPixmap();
+    m_rows.clear();
+}
+
+void VLineNumberArea::changeEvent(QEvent *p_event)
+{
+    if (p_event->type() == QEvent::FontChange) {
+        m_texts.clear();
+        m_boldTexts.clear();
+        invalidateCache();
+    }
+
+    QWidget::changeEvent(p_event);
+}
+
+void VLineNumberArea::scrollCache(int p_offset)
+{
+    int dy = p_offset - m_cacheOffset;
+    if (dy == 0) {
+        return;
+    }
+
+    qreal dpr = m_cache.devicePixelRatio();
+    if (qAbs(dy) >= height() || qFloor(dy * dpr) != dy * dpr) {
+        // Nothing to reuse, or could not be scrolled by whole pixels.
+        m_cache.fill(m_backgroundColor);
+        m_rows.clear();
+        return;
+    }
+
+    m_cache.scroll(0, dy * dpr, m_cache.rect());
+
+    // Clear the band exposed.
+    QPainter painter(&m_cache);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    if (dy > 0) {
+        painter.fillRect(0, 0, width(), dy, m_backgroundColor);
+    } else {
+        painter.fillRect(0, height() + dy, width(), -dy, m_backgroundColor);
+    }
+
+    painter.end();
+
+    QVector<Row> rows;
+    for (auto const & row : m_rows) {
+        Row shifted = row;
+        shifted.m_top += dy;
+        if (shifted.m_top + m_digitHeight > 0 && shifted.m_top < height()) {
+            rows.append(shifted);
+        }
+    }
+
+    m_rows = rows;
+}
+
+QRect VLineNumberArea::rowRect(const Row &p_row) const
+{
+    return QRect(0, p_row.m_top, width(), m_digitHeight);
+}
+
+void VLineNumberArea::clearRow(QPainter *p_painter, const Row &p_row)
+{
+    p_painter->setCompositionMode(QPainter::CompositionMode_Source);
+    p_painter->fillRect(rowRect(p_row), m_backgroundColor);
+    p_painter->setCompositionMode(QPainter::CompositionMode_SourceOver);
+}
+
+void VLineNumberArea::drawRow(QPainter *p_painter, const Row &p_row)
+{
+    const QStaticText &text = numberText(p_row.m_number, p_row.m_bold);
+    QFont font = p_painter->font();
+    font.setBold(p_row.m_bold);
+    p_painter->setFont(font);
+    p_painter->setPen(m_foregroundColor);
+    p_painter->drawStaticText(QPointF(width() - text.size().width(), p_row.m_top), text);
+}
+
+const QStaticText &VLineNumberArea::numberText(int p_number, bool p_bold)
+{
+    QHash<int, QStaticText> &texts = p_bold ? m_boldTexts : m_texts;
+    auto it = texts.find(p_number);
+    if (it != texts.end()) {
+        return it.value();
+    }
+
+    if (texts.size() >= c_maximumCachedTexts) {
+        texts.clear();
+    }
+
+    QFont textFont = font();
+    textFont.setBold(p_bold);
+    QStaticText text(QString::number(p_number));
+    text.setTextFormat(Qt::PlainText);
+    text.prepare(QTransform(), textFont);
+    return texts.insert(p_number, text).value();
+}
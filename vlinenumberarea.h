@@ -3,6 +3,10 @@
 
 #include <QWidget>
 #include <QColor>
+#include <QPixmap>
+#include <QVector>
+#include <QHash>
+#include <QStaticText>
 
 class QPaintEvent;
 class QTextDocument;
@@ -28,10 +32,31 @@ public:
 
 
 // To use VLineNumberArea, the editor should implement VTextEditWithLineNumber.
+// The line numbers are drawn into a cached pixmap, which is scrolled along with
+// the contents. Only the rows changed are drawn again.
 class VLineNumberArea : public QWidget
 {
     Q_OBJECT
 public:
+    // A line number drawn at one row of the area.
+    struct Row
+    {
+        bool operator==(const Row &p_other) const
+        {
+            return m_top == p_other.m_top
+                   && m_number == p_other.m_number
+                   && m_bold == p_other.m_bold;
+        }
+
+        // Top of the text.
+        int m_top;
+
+        int m_number;
+
+        // Whether emphasized, such as the current line.
+        bool m_bold;
+    };
+
     VLineNumberArea(VTextEditWithLineNumber *p_editor,
                     const QTextDocument *p_document,
                     int p_digitWidth,
@@ -45,6 +70,11 @@ public:
 
     int calculateWidth() const;
 
+    // Reserve the width of at least @p_digits digits, so that the width, and
+    // hence the width of the text, does not change until the number of blocks
+    // has more digits.
+    void setReservedDigits(int p_digits);
+
     int getDigitHeight() const
     {
         return m_digitHeight;
@@ -56,21 +86,61 @@ public:
     const QColor &getForegroundColor() const;
     void setForegroundColor(const QColor &p_color);
 
+    // Paint rows @p_rows, sorted by top, of the whole area, then the part
+    // @p_rect of the area. Changed rows outside @p_rect are updated later.
+    // Should be called in paintLineNumberArea().
+    // @p_offset: the Y offset of the contents. The cached rows are scrolled
+    // when it changes.
+    void paintRows(const QRect &p_rect, const QVector<Row> &p_rows, int p_offset);
+
+    // Drop the cached pixmap.
+    void invalidateCache();
+
 protected:
     void paintEvent(QPaintEvent *p_event) Q_DECL_OVERRIDE
     {
         m_editor->paintLineNumberArea(p_event);
     }
 
+    void changeEvent(QEvent *p_event) Q_DECL_OVERRIDE;
+
 private:
+    // Scroll the cached pixmap and rows along with the contents.
+    void scrollCache(int p_offset);
+
+    // Band of row @p_row in the area.
+    QRect rowRect(const Row &p_row) const;
+
+    // Clear the band of row @p_row in the cached pixmap.
+    void clearRow(QPainter *p_painter, const Row &p_row);
+
+    void drawRow(QPainter *p_painter, const Row &p_row);
+
+    // Laid out text of number @p_number.
+    const QStaticText &numberText(int p_number, bool p_bold);
+
     VTextEditWithLineNumber *m_editor;
     const QTextDocument *m_document;
     int m_width;
     int m_blockCount;
     int m_digitWidth;
     int m_digitHeight;
+    int m_reservedDigits;
     QColor m_foregroundColor;
     QColor m_backgroundColor;
+
+    // Line numbers of the area drawn already.
+    QPixmap m_cache;
+
+    // Rows drawn in m_cache.
+    QVector<Row> m_rows;
+
+    // Offset of the contents when m_cache was drawn.
+    int m_cacheOffset;
+
+    QHash<int, QStaticText> m_texts;
+
+    QHash<int, QStaticText> m_boldTexts;
 };
 
 inline const QColor &VLineNumberArea::getBackgroundColor() const
@@ -81,6 +151,7 @@ inline const QColor &VLineNumberArea::getBackgroundColor() const
 inline void VLineNumberArea::setBackgroundColor(const QColor &p_color)
 {
     m_backgroundColor = p_color;
+    invalidateCache();
 }
 
 inline const QColor &VLineNumberArea::getForegroundColor() const
@@ -91,6 +162,7 @@ inline const QColor &VLineNumberArea::getForegroundColor() const
 inline void VLineNumberArea::setForegroundColor(const QColor &p_color)
 {
     m_foregroundColor = p_color;
+    invalidateCache();
 }
 
 #endif // VLINENUMBERAREA_H
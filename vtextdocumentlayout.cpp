@@ -8,18 +8,57 @@
 #include <QFontMetrics>
 #include <QFont>
 #include <QPainter>
-#include <QDebug>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QtMath>
+#include <QFontDatabase>
+#include <QThreadPool>
+
+#include <algorithm>
 
 #include "vimageresourcemanager2.h"
 #include "vtextedit.h"
+#include "vtracer.h"
+
+
+// Heights are kept in fixed point with 1/64 pixel precision, so that adding up
+// the heights of millions of blocks does not accumulate errors.
+static const int c_fixedPointScale = 64;
+
+static inline qint64 toFixedPoint(qreal p_val)
+{
+    return qRound64(p_val * c_fixedPointScale);
+}
+
+static inline qreal fromFixedPoint(qint64 p_val)
+{
+    return p_val / (qreal)c_fixedPointScale;
+}
+
+// In lazy layout mode, changes affecting no more than this number of blocks
+// are still laid out immediately to avoid estimated heights around the cursor.
+static const int c_eagerLayoutBlockCount = 256;
+
+// Background layout handles the viewport first, then a band of this number
+// of viewport heights above and below it, then the rest of the document.
+static const int c_prefetchPages = 2;
+
+// Default memory limit of the raster cache of blocks in bytes.
+static const int c_defaultRasterCacheLimit = 32 * 1024 * 1024;
 
+// Images taller than this are drawn by tiles of this height, only the ones
+// intersecting the clip.
+static const int c_imageTileHeight = 512;
+
+// Selections are indexed by position once there are more than this number of
+// them, such as all the matches of a search.
+static const int c_maximumUnindexedSelections = 16;
 
 VTextDocumentLayout::VTextDocumentLayout(QTextDocument *p_doc,
                                          VImageResourceManager2 *p_imageMgr)
     : QAbstractTextDocumentLayout(p_doc),
       m_margin(p_doc->documentMargin()),
       m_width(0),
-      m_maximumWidthBlockNumber(-1),
       m_height(0),
       m_lineLeading(0),
       m_blockCount(0),
@@ -27,8 +66,120 @@ VTextDocumentLayout::VTextDocumentLayout(QTextDocument *p_doc,
       m_cursorMargin(4),
       m_imageMgr(p_imageMgr),
       m_blockImageEnabled(false),
-      m_imageWidthConstrainted(false)
+      m_imageWidthConstrainted(false),
+      m_lazyLayoutEnabled(false),
+      m_estimatedLineHeight(0),
+      m_estimatedCharWidth(0),
+      m_lazyUpdatePending(false),
+      m_lazyUpdateTop(-1),
+      m_lazyAnchorShift(0),
+      m_laidOutBlockCount(0),
+      m_layoutTimeBudget(4),
+      m_backgroundLayoutCursor(0),
+      m_layoutProgress(100),
+      m_parallelLayoutEnabled(false),
+      m_bulkLayoutPublishedChunks(0),
+      m_bulkLayoutGeneration(0),
+      m_inBackgroundLayout(false),
+      m_selectionIndexValid(false),
+      m_rasterCacheEnabled(false)
+{
+    setRasterCacheLimit(c_defaultRasterCacheLimit);
+
+    m_layoutTimer = new QTimer(this);
+    m_layoutTimer->setSingleShot(true);
+    m_layoutTimer->setInterval(0);
+    connect(m_layoutTimer, &QTimer::timeout,
+            this, &VTextDocumentLayout::layoutInBackground);
+}
+
+VTextDocumentLayout::~VTextDocumentLayout()
+{
+    cancelBulkLayout();
+}
+
+// Return the part of image target rect @p_targetRect to draw within @p_clip,
+// aligned to tiles so that the same source rows are drawn across paints.
+// Return an empty rect if no part of it is inside @p_clip.
+static QRect visibleImageRect(const QRect &p_targetRect, const QRectF &p_clip)
+{
+    if (!p_clip.isValid()) {
+        return p_targetRect;
+    }
+
+    if (!p_clip.intersects(QRectF(p_targetRect))) {
+        return QRect();
+    }
+
+    int height = p_targetRect.height();
+    if (height <= c_imageTileHeight) {
+        return p_targetRect;
+    }
+
+    int top = qMax(qFloor(p_clip.top()) - p_targetRect.top(), 0);
+    int bottom = qMin(qCeil(p_clip.bottom()) - p_targetRect.top(), height);
+    top = top / c_imageTileHeight * c_imageTileHeight;
+    bottom = qMin((bottom + c_imageTileHeight - 1) / c_imageTileHeight * c_imageTileHeight,
+                  height);
+    return QRect(p_targetRect.left(),
+                 p_targetRect.top() + top,
+                 p_targetRect.width(),
+                 bottom - top);
+}
+
+// Draw the part @p_rect of @p_image stretched to @p_targetRect.
+static void drawImagePart(QPainter *p_painter,
+                          const QRect &p_targetRect,
+                          const QRect &p_rect,
+                          const QPixmap &p_image)
+{
+    if (p_rect == p_targetRect) {
+        p_painter->drawPixmap(p_targetRect, p_image);
+        return;
+    }
+
+    // Source rect is in device pixels of the image.
+    qreal scale = (qreal)p_image.height() / p_targetRect.height();
+    QRectF sourceRect(0,
+                      (p_rect.top() - p_targetRect.top()) * scale,
+                      p_image.width(),
+                      p_rect.height() * scale);
+    p_painter->drawPixmap(QRectF(p_rect), p_image, sourceRect);
+}
+
+// Append the range of @p_selection within @p_block to @p_ranges if any.
+static void appendFormatRange(const QTextBlock &p_block,
+                              const QAbstractTextDocumentLayout::Selection &p_selection,
+                              QVector<QTextLayout::FormatRange> &p_ranges)
 {
+    int blpos = p_block.position();
+    int bllen = p_block.length();
+    const int selStart = p_selection.cursor.selectionStart() - blpos;
+    const int selEnd = p_selection.cursor.selectionEnd() - blpos;
+    if (selStart < bllen
+        && selEnd > 0
+        && selEnd > selStart) {
+        QTextLayout::FormatRange o;
+        o.start = selStart;
+        o.length = selEnd - selStart;
+        o.format = p_selection.format;
+        p_ranges.append(o);
+    } else if (!p_selection.cursor.hasSelection()
+               && p_selection.format.hasProperty(QTextFormat::FullWidthSelection)
+               && p_block.contains(p_selection.cursor.position())) {
+        // For full width selections we don't require an actual selection, just
+        // a position to specify the line. that's more convenience in usage.
+        QTextLayout::FormatRange o;
+        QTextLine l = p_block.layout()->lineForTextPosition(p_selection.cursor.position() - blpos);
+        o.start = l.textStart();
+        o.length = l.textLength();
+        if (o.start + o.length == bllen - 1) {
+            ++o.length; // include newline
+        }
+
+        o.format = p_selection.format;
+        p_ranges.append(o);
+    }
 }
 
 static void fillBackground(QPainter *p_painter,
@@ -70,11 +221,10 @@ void VTextDocumentLayout::blockRangeFromRect(const QRectF &p_rect,
     Q_ASSERT(document()->blockCount() == m_blocks.size());
     QTextBlock block = document()->firstBlock();
     while (block.isValid()) {
-        const BlockInfo &info = m_blocks[block.blockNumber()];
-        Q_ASSERT(info.hasOffset());
-
-        if (info.top() == y
-            || (info.top() < y && info.bottom() >= y)) {
+        int num = block.blockNumber();
+        qreal top = blockTop(num);
+        if (top == y
+            || (top < y && blockBottom(num) >= y)) {
             p_first = block.blockNumber();
             break;
         }
@@ -89,18 +239,14 @@ void VTextDocumentLayout::blockRangeFromRect(const QRectF &p_rect,
 
     y += p_rect.height();
     while (block.isValid()) {
-        const BlockInfo &info = m_blocks[block.blockNumber()];
-        Q_ASSERT(info.hasOffset());
-
-        if (info.bottom() > y) {
+        int num = block.blockNumber();
+        if (blockBottom(num) > y) {
             p_last = block.blockNumber();
             break;
         }
 
         block = block.next();
     }
-
-    qDebug() << "block range" << p_first << p_last;
 }
 
 void VTextDocumentLayout::blockRangeFromRectBS(const QRectF &p_rect,
@@ -122,66 +268,89 @@ void VTextDocumentLayout::blockRangeFromRectBS(const QRectF &p_rect,
         return;
     }
 
-    int y = p_rect.bottom();
-    QTextBlock block = document()->findBlockByNumber(p_first);
-
-    if (m_blocks[p_first].top() == p_rect.top()
+    if (blockTop(p_first) == p_rect.top()
         && p_first > 0) {
         --p_first;
     }
 
-    p_last = m_blocks.size() - 1;
-    while (block.isValid()) {
-        const BlockInfo &info = m_blocks[block.blockNumber()];
-        Q_ASSERT(info.hasOffset());
+    // The last block is the first one whose bottom is below @p_rect.
+    int y = p_rect.bottom();
+    p_last = m_blocks.findByPrefixSum(toFixedPoint(y));
+    if (p_last >= m_blocks.size()) {
+        p_last = m_blocks.size() - 1;
+    } else if (p_last < p_first) {
+        p_last = p_first;
+    }
+}
 
-        if (info.bottom() > y) {
-            p_last = block.blockNumber();
-            break;
+QVector<VBlockGeometry> VTextDocumentLayout::blockGeometries(qreal p_top, qreal p_bottom)
+{
+    V_TRACE_SPAN("blockGeometries");
+
+    QVector<VBlockGeometry> geos;
+    if (m_blocks.isEmpty() || p_bottom < p_top) {
+        return geos;
+    }
+
+    QRectF rect(0, p_top, 1, p_bottom - p_top);
+    // Heights within the range should be accurate like blockBoundingRect().
+    layoutBlocksInRect(rect);
+
+    int first, last;
+    blockRangeFromRectBS(rect, first, last);
+    if (first == -1) {
+        return geos;
+    }
+
+    geos.reserve(last - first + 1);
+    QVector<qint64> heights;
+    m_blocks.values(first, last - first + 1, heights);
+    qreal top = blockTop(first);
+    QTextBlock block = document()->findBlockByNumber(first);
+    for (int num = first; num <= last && block.isValid(); ++num) {
+        qreal height = fromFixedPoint(heights[num - first]);
+        if (top + height >= p_top) {
+            VBlockGeometry geo;
+            geo.m_blockNumber = num;
+            geo.m_top = top;
+            geo.m_height = height;
+            geo.m_visible = block.isVisible();
+            geo.m_lineCount = block.layout()->lineCount();
+            geo.m_userState = block.userState();
+            geos.append(geo);
         }
 
+        top += height;
         block = block.next();
     }
 
-    qDebug() << "block range" << p_first << p_last;
-
+    return geos;
 }
 
 int VTextDocumentLayout::findBlockByPosition(const QPointF &p_point) const
 {
-    int first = 0, last = m_blocks.size() - 1;
-    int y = p_point.y();
-    while (first <= last) {
-        int mid = (first + last) / 2;
-        const BlockInfo &info = m_blocks[mid];
-        Q_ASSERT(info.hasOffset());
-        if (info.top() <= y && info.bottom() > y) {
-            // Found it.
-            return mid;
-        } else if (info.top() > y) {
-            last = mid - 1;
-        } else {
-            first = mid + 1;
-        }
-    }
-
-    int idx = previousValidBlockNumber(m_blocks.size());
-    if (y >= m_blocks[idx].bottom()) {
-        return idx;
+    if (m_blocks.isEmpty()) {
+        return -1;
     }
 
-    idx = nextValidBlockNumber(-1);
-    if (y < m_blocks[idx].top()) {
-        return idx;
+    int y = p_point.y();
+    int idx = m_blocks.findByPrefixSum(toFixedPoint(y));
+    if (idx >= m_blocks.size()) {
+        // Below the last block.
+        idx = previousValidBlockNumber(m_blocks.size());
     }
 
-    Q_ASSERT(false);
-    return -1;
+    return idx;
 }
 
 void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_context)
 {
-    qDebug() << "VTextDocumentLayout draw()" << p_context.clip << p_context.cursorPosition << p_context.selections.size();
+    V_STATS_TIME_SCOPE(m_stats, VLayoutStats::Draw);
+    V_TRACE_SPAN("draw");
+
+    // Blocks may be left unlaid in any mode, such as the ones measured by the
+    // bulk layout job or left after lazy layout is turned off.
+    layoutBlocksInRect(p_context.clip);
 
     // Find out the blocks.
     int first, last;
@@ -190,9 +359,15 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
         return;
     }
 
+    if (m_blockImageEnabled) {
+        updateActiveImages(p_context.clip);
+    }
+
+    updateSelectionIndex(p_context.selections);
+
     QTextDocument *doc = document();
     Q_ASSERT(doc->blockCount() == m_blocks.size());
-    QPointF offset(m_margin, m_blocks[first].top());
+    QPointF offset(m_margin, blockTop(first));
     QTextBlock block = doc->findBlockByNumber(first);
     QTextBlock lastBlock = doc->findBlockByNumber(last);
 
@@ -201,7 +376,7 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
 
     while (block.isValid()) {
         const BlockInfo &info = m_blocks[block.blockNumber()];
-        Q_ASSERT(info.hasOffset());
+        Q_ASSERT(info.hasRect());
 
         const QRectF &rect = info.m_rect;
         QTextLayout *layout = block.layout();
@@ -216,20 +391,31 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
             continue;
         }
 
-        QTextBlockFormat blockFormat = block.blockFormat();
-        QBrush bg = blockFormat.background();
-        if (bg != Qt::NoBrush) {
-            fillBackground(p_painter, rect, bg);
-        }
+        V_STATS_ADD(m_stats, m_blocksDrawn, 1);
 
         auto selections = formatRangeFromSelection(block, p_context.selections);
 
-        layout->draw(p_painter,
-                     offset,
-                     selections,
-                     p_context.clip.isValid() ? p_context.clip : QRectF());
+        // Blocks with selections or preedit text are always drawn directly.
+        // The cursor is drawn over the cached pixmap.
+        bool cached = m_rasterCacheEnabled
+                      && selections.isEmpty()
+                      && layout->preeditAreaText().isEmpty()
+                      && !hasAnimatedImage(block.blockNumber())
+                      && drawBlockFromCache(p_painter, block, offset, p_context.palette);
+        if (!cached) {
+            QTextBlockFormat blockFormat = block.blockFormat();
+            QBrush bg = blockFormat.background();
+            if (bg != Qt::NoBrush) {
+                fillBackground(p_painter, rect, bg);
+            }
+
+            layout->draw(p_painter,
+                         offset,
+                         selections,
+                         p_context.clip.isValid() ? p_context.clip : QRectF());
 
-        drawBlockImage(p_painter, block, offset);
+            drawBlockImage(p_painter, block, offset, p_context.clip);
+        }
 
         // Draw the cursor.
         int blpos = block.position();
@@ -260,44 +446,254 @@ void VTextDocumentLayout::draw(QPainter *p_painter, const PaintContext &p_contex
     p_painter->setPen(oldPen);
 }
 
+bool VTextDocumentLayout::drawBlockFromCache(QPainter *p_painter,
+                                             const QTextBlock &p_block,
+                                             const QPointF &p_offset,
+                                             const QPalette &p_palette)
+{
+    int num = p_block.blockNumber();
+    const QRectF &rect = m_blocks[num].m_rect;
+    qreal dpr = p_painter->device()->devicePixelRatioF();
+    qint64 paletteKey = p_palette.cacheKey();
+
+    RasterCacheEntry *entry = m_rasterCache.object(num);
+    if (!entry
+        || entry->m_revision != p_block.revision()
+        || entry->m_size != rect.size()
+        || entry->m_paletteKey != paletteKey
+        || entry->m_devicePixelRatio != dpr) {
+        QSize pixelSize = (rect.size() * dpr).toSize();
+        int cost = (qint64)pixelSize.width() * pixelSize.height() * 4 / 1024;
+        if (pixelSize.isEmpty() || cost > m_rasterCache.maxCost()) {
+            // Too large to cache.
+            m_rasterCache.remove(num);
+            return false;
+        }
+
+        entry = new RasterCacheEntry();
+        entry->m_revision = p_block.revision();
+        entry->m_size = rect.size();
+        entry->m_paletteKey = paletteKey;
+        entry->m_devicePixelRatio = dpr;
+        entry->m_pixmap = QPixmap(pixelSize);
+        entry->m_pixmap.setDevicePixelRatio(dpr);
+        // Text on a transparent pixmap loses subpixel antialiasing, so render
+        // it opaquely over the background of the editor as drawn directly.
+        entry->m_pixmap.fill(p_palette.color(QPalette::Base));
+
+        // Render the block in its own coordinates.
+        QPainter painter(&entry->m_pixmap);
+        painter.setRenderHints(p_painter->renderHints());
+        painter.setFont(p_painter->font());
+        painter.setPen(p_palette.color(QPalette::Text));
+
+        QBrush bg = p_block.blockFormat().background();
+        if (bg != Qt::NoBrush) {
+            fillBackground(&painter, QRectF(QPointF(0, 0), rect.size()), bg);
+        }
+
+        QPointF offset(p_offset.x(), 0);
+        p_block.layout()->draw(&painter, offset);
+        drawBlockImage(&painter, p_block, offset, QRectF());
+        painter.end();
+
+        if (!m_rasterCache.insert(num, entry, qMax(cost, 1))) {
+            return false;
+        }
+    } else {
+        V_STATS_ADD(m_stats, m_cachedBlocksDrawn, 1);
+    }
+
+    p_painter->drawPixmap(QPointF(0, p_offset.y()), entry->m_pixmap);
+    return true;
+}
+
+void VTextDocumentLayout::invalidateRasterCache(int p_fromBlock)
+{
+    if (p_fromBlock <= 0) {
+        m_rasterCache.clear();
+        return;
+    }
+
+    const QList<int> keys = m_rasterCache.keys();
+    for (int key : keys) {
+        if (key >= p_fromBlock) {
+            m_rasterCache.remove(key);
+        }
+    }
+}
+
+void VTextDocumentLayout::updateActiveImages(const QRectF &p_clip)
+{
+    // The clip may be just part of the viewport.
+    QRectF rect = m_viewportRect.isNull() ? p_clip : m_viewportRect;
+    qreal band = c_prefetchPages * rect.height();
+    int first, last;
+    blockRangeFromRectBS(rect.adjusted(0, -band, 0, band), first, last);
+    int visibleFirst, visibleLast;
+    blockRangeFromRectBS(rect, visibleFirst, visibleLast);
+    m_imageMgr->setActiveBlockRange(first, last, visibleFirst, visibleLast);
+}
+
+void VTextDocumentLayout::relayoutBlocks(const QVector<int> &p_blockNumbers)
+{
+    QTextDocument *doc = document();
+    for (int num : p_blockNumbers) {
+        if (num < 0 || num >= m_blocks.size()) {
+            continue;
+        }
+
+        QTextBlock block = doc->findBlockByNumber(num);
+        m_rasterCache.remove(num);
+
+        qint64 oldHeight = m_blocks.value(num);
+        qreal top = blockTop(num);
+        if (isBlockLaidOut(block)) {
+            // The lines of text are not affected.
+            finishBlockLayout(block);
+        } else {
+            setBlockHeight(num, estimateBlockHeight(block));
+        }
+
+        if (m_blocks.value(num) == oldHeight) {
+            emit updateBlock(block);
+        } else {
+            handleLazyHeightChange(num, top, oldHeight);
+        }
+    }
+}
+
+void VTextDocumentLayout::updateBlocks(const QVector<int> &p_blockNumbers)
+{
+    QTextDocument *doc = document();
+    for (int num : p_blockNumbers) {
+        if (num < 0 || num >= m_blocks.size()) {
+            continue;
+        }
+
+        m_rasterCache.remove(num);
+        emit updateBlock(doc->findBlockByNumber(num));
+    }
+}
+
+void VTextDocumentLayout::updateBlockImageRects(const QVector<int> &p_blockNumbers)
+{
+    if (!m_blockImageEnabled) {
+        return;
+    }
+
+    QTextDocument *doc = document();
+    for (int num : p_blockNumbers) {
+        if (num < 0 || num >= m_blocks.size()) {
+            continue;
+        }
+
+        QTextBlock block = doc->findBlockByNumber(num);
+        const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(num);
+        if (!info || info->m_imageSize.isNull() || !isBlockLaidOut(block)) {
+            // Not drawn yet.
+            continue;
+        }
+
+        m_rasterCache.remove(num);
+        emit update(blockImageRect(block, info, QPointF(m_margin, blockTop(num))));
+    }
+}
+
+void VTextDocumentLayout::setRasterCacheEnabled(bool p_enabled)
+{
+    m_rasterCacheEnabled = p_enabled;
+    if (!m_rasterCacheEnabled) {
+        m_rasterCache.clear();
+    }
+}
+
+void VTextDocumentLayout::setRasterCacheLimit(int p_bytes)
+{
+    m_rasterCache.setMaxCost(qMax(1, p_bytes / 1024));
+}
+
 QVector<QTextLayout::FormatRange> VTextDocumentLayout::formatRangeFromSelection(const QTextBlock &p_block,
                                                                                 const QVector<Selection> &p_selections) const
 {
     QVector<QTextLayout::FormatRange> ret;
+    if (p_selections.isEmpty()) {
+        return ret;
+    }
 
+    // Overlapping ranges are drawn in the order of the selections.
     int blpos = p_block.position();
-    int bllen = p_block.length();
-    for (int i = 0; i < p_selections.size(); ++i) {
-        const QAbstractTextDocumentLayout::Selection &range = p_selections.at(i);
-        const int selStart = range.cursor.selectionStart() - blpos;
-        const int selEnd = range.cursor.selectionEnd() - blpos;
-        if (selStart < bllen
-            && selEnd > 0
-            && selEnd > selStart) {
-            QTextLayout::FormatRange o;
-            o.start = selStart;
-            o.length = selEnd - selStart;
-            o.format = range.format;
-            ret.append(o);
-        } else if (!range.cursor.hasSelection()
-                   && range.format.hasProperty(QTextFormat::FullWidthSelection)
-                   && p_block.contains(range.cursor.position())) {
-            // For full width selections we don't require an actual selection, just
-            // a position to specify the line. that's more convenience in usage.
-            QTextLayout::FormatRange o;
-            QTextLine l = p_block.layout()->lineForTextPosition(range.cursor.position() - blpos);
-            o.start = l.textStart();
-            o.length = l.textLength();
-            if (o.start + o.length == bllen - 1) {
-                ++o.length; // include newline
+    QVector<int> indexes;
+    m_selectionIndex.overlap(blpos, blpos + p_block.length(), indexes);
+    std::sort(indexes.begin(), indexes.end());
+    for (int idx : indexes) {
+        appendFormatRange(p_block, p_selections.at(idx), ret);
+    }
+
+    for (int i = m_selectionRanges.size(); i < p_selections.size(); ++i) {
+        appendFormatRange(p_block, p_selections.at(i), ret);
+    }
+
+    return ret;
+}
+
+void VTextDocumentLayout::updateSelectionIndex(const QVector<Selection> &p_selections)
+{
+    // m_checkedSelections shares the data of the selections checked last,
+    // which could not be changed without being detached. So the same data
+    // has the same selections, unless the text changed and moved their
+    // cursors. Otherwise, such as selections set again or the selection of
+    // the cursor appended to a copy, their ranges are compared.
+    const int cnt = m_selectionRanges.size();
+    bool fit = cnt <= p_selections.size()
+               && p_selections.size() - cnt <= c_maximumUnindexedSelections;
+    if (fit
+        && m_selectionIndexValid
+        && p_selections.constData() == m_checkedSelections.constData()) {
+        return;
+    }
+
+    m_checkedSelections = p_selections;
+    m_selectionIndexValid = true;
+    if (fit) {
+        bool same = true;
+        for (int i = 0; i < cnt; ++i) {
+            const QTextCursor &cursor = p_selections.at(i).cursor;
+            const SelectionRange &range = m_selectionRanges.at(i);
+            if (cursor.selectionStart() != range.m_start
+                || cursor.selectionEnd() != range.m_end) {
+                same = false;
+                break;
             }
+        }
 
-            o.format = range.format;
-            ret.append(o);
+        if (same) {
+            return;
         }
     }
 
-    return ret;
+    V_TRACE_SPAN("updateSelectionIndex");
+
+    m_selectionRanges.clear();
+    m_selectionIndex.clear();
+    if (p_selections.size() <= c_maximumUnindexedSelections) {
+        return;
+    }
+
+    m_selectionRanges.reserve(p_selections.size());
+    for (int i = 0; i < p_selections.size(); ++i) {
+        const QTextCursor &cursor = p_selections.at(i).cursor;
+        SelectionRange range;
+        range.m_start = cursor.selectionStart();
+        range.m_end = cursor.selectionEnd();
+        m_selectionRanges.append(range);
+
+        // A full width selection without selected text still covers the
+        // block of its position.
+        m_selectionIndex.add(range.m_start, qMax(range.m_end, range.m_start + 1), i);
+    }
+
+    m_selectionIndex.build();
 }
 
 int VTextDocumentLayout::hitTest(const QPointF &p_point, Qt::HitTestAccuracy p_accuracy) const
@@ -310,9 +706,11 @@ int VTextDocumentLayout::hitTest(const QPointF &p_point, Qt::HitTestAccuracy p_a
 
     QTextBlock block = document()->findBlockByNumber(bn);
     Q_ASSERT(block.isValid());
+    const_cast<VTextDocumentLayout *>(this)->ensureBlockLayout(block);
+
     QTextLayout *layout = block.layout();
     int off = 0;
-    QPointF pos = p_point - QPointF(m_margin, m_blocks[bn].top());
+    QPointF pos = p_point - QPointF(m_margin, blockTop(bn));
     for (int i = 0; i < layout->lineCount(); ++i) {
         QTextLine line = layout->lineAt(i);
         const QRectF lr = line.naturalTextRect();
@@ -352,25 +750,43 @@ QRectF VTextDocumentLayout::blockBoundingRect(const QTextBlock &p_block) const
         return QRectF();
     }
 
-    const BlockInfo &info = m_blocks[p_block.blockNumber()];
-    QRectF geo = info.m_rect.adjusted(0, info.m_offset, 0, info.m_offset);
-    qDebug() << "blockBoundingRect()" << p_block.blockNumber()
-             << info.m_offset << info.m_rect << geo;
-    Q_ASSERT(info.hasOffset());
+    int num = p_block.blockNumber();
+    // Lay out the block on demand.
+    const_cast<VTextDocumentLayout *>(this)->ensureBlockLayout(p_block);
+
+    const BlockInfo &info = m_blocks[num];
+    qreal offset = blockTop(num);
+    QRectF geo = info.m_rect.adjusted(0, offset, 0, offset);
+    Q_ASSERT(info.hasRect());
 
     return geo;
 }
 
 void VTextDocumentLayout::documentChanged(int p_from, int p_charsRemoved, int p_charsAdded)
 {
+    V_STATS_TIME_SCOPE(m_stats, VLayoutStats::DocumentChanged);
+    V_TRACE_SPAN("documentChanged");
+
     QTextDocument *doc = document();
     int newBlockCount = doc->blockCount();
 
     // Update the margin.
     m_margin = doc->documentMargin();
 
+    updateEstimationMetrics();
+
     int charsChanged = p_charsRemoved + p_charsAdded;
 
+    // The cursors of the selections move along with the text.
+    m_selectionIndexValid = false;
+
+    // Relayout without changing the text, such as setPageSize() or a change
+    // of the default font, which reports the whole document as changed.
+    bool relayoutOnly = newBlockCount == m_blockCount
+                        && p_from == 0
+                        && p_charsAdded == doc->characterCount()
+                        && (p_charsRemoved == 0 || p_charsRemoved == p_charsAdded);
+
     QTextBlock changeStartBlock = doc->findBlock(p_from);
     // May be an invalid block.
     QTextBlock changeEndBlock = doc->findBlock(qMax(0, p_from + charsChanged));
@@ -379,56 +795,129 @@ void VTextDocumentLayout::documentChanged(int p_from, int p_charsRemoved, int p_
     if (changeStartBlock == changeEndBlock
         && newBlockCount == m_blockCount) {
         // Change single block internal only.
+        V_STATS_ADD(m_stats, m_singleBlockRelayouts, 1);
         QTextBlock block = changeStartBlock;
+        m_rasterCache.remove(block.blockNumber());
         if (block.isValid() && block.length()) {
-            QRectF oldBr = blockBoundingRect(block);
+            // Compare the heights kept in m_blocks. blockBoundingRect() would
+            // lay out the block on demand once more.
+            int num = block.blockNumber();
+            qint64 oldHeight = m_blocks.value(num);
             clearBlockLayout(block);
             layoutBlock(block);
-            QRectF newBr = blockBoundingRect(block);
             // Only one block is affected.
-            if (newBr.height() == oldBr.height()) {
+            if (m_blocks.value(num) == oldHeight) {
                 // Update document size.
-                updateDocumentSizeWithOneBlockChanged(block.blockNumber());
+                updateDocumentSizeWithOneBlockChanged();
 
                 emit updateBlock(block);
                 return;
             }
         }
     } else {
-        // Clear layout of all affected blocks.
-        QTextBlock block = changeStartBlock;
-        do {
-            clearBlockLayout(block);
-            if (block == changeEndBlock) {
-                break;
+        needRelayout = true;
+        V_STATS_ADD(m_stats, m_multiBlockRelayouts, 1);
+
+        // Blocks behind may be shifted.
+        invalidateRasterCache(changeStartBlock.blockNumber());
+
+        // Keep images attached to their blocks.
+        if (!relayoutOnly) {
+            int blockCountDelta = newBlockCount - m_blockCount;
+            // The block of the last added char ends the change. The block
+            // starting right behind the added text is not replaced.
+            QTextBlock addedEndBlock = doc->findBlock(p_from + qMax(p_charsAdded - 1, 0));
+            int addedEndNumber = addedEndBlock.isValid() ? addedEndBlock.blockNumber()
+                                                         : newBlockCount - 1;
+            int startNumber = changeStartBlock.blockNumber();
+            int oldEndNumber = addedEndNumber - blockCountDelta;
+            if (blockCountDelta > 0
+                && p_from == changeStartBlock.position()
+                && oldEndNumber <= startNumber) {
+                // Blocks inserted at the start of a block, such as pressing
+                // Enter at column 0. Its text moves down to the last added
+                // block, so does its info.
+                m_imageMgr->shiftBlockInfos(startNumber - 1, startNumber - 1, blockCountDelta);
+            } else {
+                m_imageMgr->shiftBlockInfos(startNumber, oldEndNumber, blockCountDelta);
             }
+        }
 
-            block = block.next();
-        } while(block.isValid());
-
-        needRelayout = true;
+        // Block numbers of the bulk layout job may be out of date.
+        cancelBulkLayout();
     }
 
     updateBlockCount(newBlockCount, changeStartBlock.blockNumber());
 
     if (needRelayout) {
         // Relayout all affected blocks.
+        // In lazy layout mode, a large change just gets estimated heights and
+        // its blocks will be laid out on demand.
+        // So does a relayout of the same text, such as a change of the wrap
+        // width, in either mode, keeping the old heights. The visible blocks
+        // are rewrapped first and the rest in the background.
+        int endNumber = changeEndBlock.isValid() ? changeEndBlock.blockNumber()
+                                                 : newBlockCount - 1;
+        bool lazy = (m_lazyLayoutEnabled || relayoutOnly)
+                    && endNumber - changeStartBlock.blockNumber() >= c_eagerLayoutBlockCount;
+        // Measure those blocks concurrently if possible.
+        bool bulk = lazy
+                    && m_parallelLayoutEnabled
+                    && QFontDatabase::supportsThreadedFontRendering();
+        QVector<VBulkLayoutJob::Input> bulkInputs;
         QTextBlock block = changeStartBlock;
         do {
-            layoutBlock(block);
+            qint64 oldHeight = m_blocks.value(block.blockNumber());
+            clearBlockLayout(block);
+            if (lazy) {
+                if (relayoutOnly && oldHeight > 0) {
+                    // The old height of the same text is closer than an
+                    // estimated one, which keeps the scroll position still.
+                    setBlockHeight(block.blockNumber(), fromFixedPoint(oldHeight));
+                } else {
+                    setBlockHeight(block.blockNumber(), estimateBlockHeight(block));
+                }
+
+                m_backgroundLayoutCursor = qMin(m_backgroundLayoutCursor,
+                                                block.blockNumber());
+                if (bulk) {
+                    VBulkLayoutJob::Input input;
+                    input.m_text = block.text();
+                    input.m_formats = block.textFormats() + block.layout()->formats();
+                    input.m_font = block.charFormat().font();
+                    input.m_availableWidth = availableLineWidth(input.m_font);
+                    bulkInputs.append(input);
+                }
+            } else {
+                layoutBlock(block);
+            }
+
             if (block == changeEndBlock) {
                 break;
             }
 
             block = block.next();
         } while(block.isValid());
+
+        if (!bulkInputs.isEmpty()) {
+            startBulkLayout(changeStartBlock.blockNumber(), bulkInputs);
+        }
+
+        if (lazy && !m_viewportRect.isNull()) {
+            // Wrap the visible blocks at once so that the next paint is
+            // accurate. The rest are deferred to background layout.
+            layoutBlocksInRect(m_viewportRect);
+        }
     }
 
     updateDocumentSize();
 
-    // TODO: Update the view of all the blocks after changeStartBlock.
-    const BlockInfo &firstInfo = m_blocks[changeStartBlock.blockNumber()];
-    emit update(QRectF(0., firstInfo.m_offset, 1000000000., 1000000000.));
+    updateLayoutProgress();
+    if (m_laidOutBlockCount < m_blocks.size()) {
+        m_layoutTimer->start();
+    }
+
+    updateShiftedBlocks(blockTop(changeStartBlock.blockNumber()));
 }
 
 void VTextDocumentLayout::clearBlockLayout(QTextBlock &p_block)
@@ -436,114 +925,500 @@ void VTextDocumentLayout::clearBlockLayout(QTextBlock &p_block)
     p_block.clearLayout();
     int num = p_block.blockNumber();
     if (num < m_blocks.size()) {
-        m_blocks[num].reset();
-        clearOffsetFrom(num + 1);
+        setBlockRect(num, QRectF());
     }
 }
 
-void VTextDocumentLayout::clearOffsetFrom(int p_blockNumber)
+qreal VTextDocumentLayout::blockTop(int p_blockNumber) const
 {
-    for (int i = p_blockNumber; i < m_blocks.size(); ++i) {
-        if (!m_blocks[i].hasOffset()) {
-            Q_ASSERT(validateBlocks());
-            break;
-        }
+    return fromFixedPoint(m_blocks.prefixSum(p_blockNumber));
+}
 
-        m_blocks[i].m_offset = -1;
-    }
+qreal VTextDocumentLayout::blockBottom(int p_blockNumber) const
+{
+    return fromFixedPoint(m_blocks.prefixSum(p_blockNumber + 1));
 }
 
-void VTextDocumentLayout::fillOffsetFrom(int p_blockNumber)
+void VTextDocumentLayout::setBlockHeight(int p_blockNumber, qreal p_height)
 {
-    qreal offset = m_blocks[p_blockNumber].bottom();
-    for (int i = p_blockNumber + 1; i < m_blocks.size(); ++i) {
-        BlockInfo &info = m_blocks[i];
-        if (!info.m_rect.isNull()) {
-            info.m_offset = offset;
-            offset += info.m_rect.height();
-        } else {
-            break;
-        }
-    }
+    V_STATS_ADD(m_stats, m_heightUpdates, 1);
+    m_blocks.setValue(p_blockNumber, toFixedPoint(p_height));
 }
 
-bool VTextDocumentLayout::validateBlocks() const
+void VTextDocumentLayout::ensureBlockLayout(const QTextBlock &p_block)
 {
-    bool valid = true;
-    for (int i = 0; i < m_blocks.size(); ++i) {
-        const BlockInfo &info = m_blocks[i];
-        if (!info.hasOffset()) {
-            valid = false;
-        } else if (!valid) {
-            return false;
-        }
+    if (isBlockLaidOut(p_block)) {
+        return;
     }
 
-    return true;
+    if (m_inBackgroundLayout) {
+        V_STATS_ADD(m_stats, m_backgroundLayouts, 1);
+    } else {
+        V_STATS_ADD(m_stats, m_onDemandLayouts, 1);
+    }
+
+    int num = p_block.blockNumber();
+    qint64 oldHeight = m_blocks.value(num);
+    qreal top = blockTop(num);
+    layoutBlock(p_block);
+
+    handleLazyHeightChange(num, top, oldHeight);
 }
 
-void VTextDocumentLayout::updateBlockCount(int p_count, int p_changeStartBlock)
+bool VTextDocumentLayout::isBlockLaidOut(const QTextBlock &p_block) const
+{
+    return m_blocks[p_block.blockNumber()].hasRect()
+           && p_block.layout()->lineCount() > 0;
+}
+
+void VTextDocumentLayout::handleLazyHeightChange(int p_blockNumber,
+                                                 qreal p_top,
+                                                 qint64 p_oldHeight)
+{
+    qint64 newHeight = m_blocks.value(p_blockNumber);
+    if (newHeight == p_oldHeight) {
+        scheduleLazyUpdate(-1);
+    } else if (!m_viewportRect.isNull()
+               && p_top + fromFixedPoint(p_oldHeight) <= m_viewportRect.top()) {
+        // The block is above the viewport. Keep the viewport anchored to
+        // its contents instead of shifting them.
+        qreal dy = fromFixedPoint(newHeight - p_oldHeight);
+        m_lazyAnchorShift += dy;
+        m_viewportRect.translate(0, dy);
+        scheduleLazyUpdate(-1);
+    } else {
+        // Blocks behind are shifted since the estimated height is not accurate.
+        scheduleLazyUpdate(p_top);
+    }
+}
+
+void VTextDocumentLayout::layoutBlocksInRect(const QRectF &p_rect)
 {
-    if (m_blockCount != p_count) {
-        m_blockCount = p_count;
-        m_blocks.resize(m_blockCount);
+    // Laying out a block may change its height and shift the blocks behind,
+    // so repeat until all the blocks within @p_rect have been laid out.
+    while (true) {
+        int first, last;
+        blockRangeFromRectBS(p_rect, first, last);
+        if (first == -1) {
+            return;
+        }
 
-        // Fix m_blocks.
-        QTextBlock block = document()->findBlockByNumber(p_changeStartBlock);
+        bool laidOut = false;
+        QTextBlock block = document()->findBlockByNumber(first);
         while (block.isValid()) {
-            BlockInfo &info = m_blocks[block.blockNumber()];
-            info.reset();
+            if (!isBlockLaidOut(block)) {
+                ensureBlockLayout(block);
+                laidOut = true;
+            }
 
-            QRectF br = blockRectFromTextLayout(block);
-            if (!br.isNull()) {
-                info.m_rect = br;
+            if (block.blockNumber() == last) {
+                break;
             }
 
             block = block.next();
         }
+
+        if (!laidOut) {
+            return;
+        }
     }
 }
 
-void VTextDocumentLayout::layoutBlock(const QTextBlock &p_block)
+void VTextDocumentLayout::scheduleLazyUpdate(qreal p_top)
 {
-    QTextDocument *doc = document();
-    Q_ASSERT(m_margin == doc->documentMargin());
-
-    // The height (y) of the next line.
-    qreal height = 0;
-    QTextLayout *tl = p_block.layout();
-    QTextOption option = doc->defaultTextOption();
-    tl->setTextOption(option);
+    if (p_top > -1
+        && (m_lazyUpdateTop < 0 || p_top < m_lazyUpdateTop)) {
+        m_lazyUpdateTop = p_top;
+    }
 
-    int extraMargin = 0;
-    if (option.flags() & QTextOption::AddSpaceForLineAndParagraphSeparators) {
-        QFontMetrics fm(p_block.charFormat().font());
-        extraMargin += fm.width(QChar(0x21B5));
+    if (!m_lazyUpdatePending) {
+        m_lazyUpdatePending = true;
+        // Do not touch the scroll bars while painting.
+        QTimer::singleShot(0, this, &VTextDocumentLayout::finishLazyUpdate);
     }
+}
 
-    qreal availableWidth = doc->pageSize().width();
+void VTextDocumentLayout::finishLazyUpdate()
+{
+    m_lazyUpdatePending = false;
+
+    if (m_blocks.isEmpty()) {
+        return;
+    }
+
+    updateDocumentSize();
+
+    if (m_lazyAnchorShift != 0) {
+        qreal dy = m_lazyAnchorShift;
+        m_lazyAnchorShift = 0;
+        emit contentShiftedAboveViewport(dy);
+    }
+
+    if (m_lazyUpdateTop > -1) {
+        updateShiftedBlocks(m_lazyUpdateTop);
+        m_lazyUpdateTop = -1;
+    }
+}
+
+void VTextDocumentLayout::updateShiftedBlocks(qreal p_top)
+{
+    if (m_viewportRect.isNull()) {
+        emit update(QRectF(0., p_top, 1000000000., 1000000000.));
+        return;
+    }
+
+    qreal bottom = m_viewportRect.bottom();
+    if (p_top < bottom) {
+        emit update(QRectF(0., p_top, 1000000000., bottom - p_top));
+    }
+}
+
+void VTextDocumentLayout::layoutInBackground()
+{
+    if (m_blocks.isEmpty()) {
+        return;
+    }
+
+    V_TRACE_SPAN("layoutInBackground");
+
+    QElapsedTimer timer;
+    timer.start();
+
+    m_inBackgroundLayout = true;
+
+    bool finished = true;
+    if (!m_viewportRect.isNull()) {
+        qreal band = c_prefetchPages * m_viewportRect.height();
+        finished = layoutBlocksInRectWithinBudget(m_viewportRect, timer)
+                   && layoutBlocksInRectWithinBudget(m_viewportRect.adjusted(0, -band, 0, band),
+                                                     timer);
+    }
+
+    // Leave the rest to the bulk layout job if there is one.
+    if (finished && m_bulkLayoutJob.isNull()) {
+        finished = layoutRestWithinBudget(timer);
+    }
+
+    m_inBackgroundLayout = false;
+
+    updateLayoutProgress();
+
+    if (!finished) {
+        m_layoutTimer->start();
+    }
+}
+
+bool VTextDocumentLayout::layoutBlocksInRectWithinBudget(const QRectF &p_rect,
+                                                         const QElapsedTimer &p_timer)
+{
+    int first, last;
+    blockRangeFromRectBS(p_rect, first, last);
+    if (first == -1) {
+        return true;
+    }
+
+    QTextBlock block = document()->findBlockByNumber(first);
+    while (block.isValid()) {
+        if (!isBlockLaidOut(block)) {
+            ensureBlockLayout(block);
+            if (p_timer.hasExpired(m_layoutTimeBudget)) {
+                return false;
+            }
+        }
+
+        if (block.blockNumber() == last) {
+            break;
+        }
+
+        block = block.next();
+    }
+
+    return true;
+}
+
+bool VTextDocumentLayout::layoutRestWithinBudget(const QElapsedTimer &p_timer)
+{
+    if (m_backgroundLayoutCursor >= m_blocks.size()) {
+        m_backgroundLayoutCursor = 0;
+    }
+
+    QTextBlock block = document()->findBlockByNumber(m_backgroundLayoutCursor);
+    while (m_laidOutBlockCount < m_blocks.size()) {
+        if (!block.isValid()) {
+            // Blocks before the cursor may have been changed. Wrap around.
+            block = document()->firstBlock();
+        }
+
+        if (!m_blocks[block.blockNumber()].hasRect()) {
+            ensureBlockLayout(block);
+            if (p_timer.hasExpired(m_layoutTimeBudget)) {
+                m_backgroundLayoutCursor = block.blockNumber() + 1;
+                return m_laidOutBlockCount == m_blocks.size();
+            }
+        }
+
+        block = block.next();
+    }
+
+    m_backgroundLayoutCursor = m_blocks.size();
+    return true;
+}
+
+void VTextDocumentLayout::updateLayoutProgress()
+{
+    int progress = layoutProgress();
+    if (progress != m_layoutProgress) {
+        m_layoutProgress = progress;
+        emit layoutProgressChanged(m_layoutProgress);
+    }
+}
+
+int VTextDocumentLayout::layoutProgress() const
+{
+    if (m_blocks.isEmpty()) {
+        return 100;
+    }
+
+    return (int)((qint64)m_laidOutBlockCount * 100 / m_blocks.size());
+}
+
+void VTextDocumentLayout::setViewportRect(const QRectF &p_rect)
+{
+    m_viewportRect = p_rect;
+}
+
+void VTextDocumentLayout::setLayoutTimeBudget(int p_ms)
+{
+    if (p_ms > 0) {
+        m_layoutTimeBudget = p_ms;
+    }
+}
+
+void VTextDocumentLayout::startBulkLayout(int p_firstBlock,
+                                          QVector<VBulkLayoutJob::Input> &p_inputs)
+{
+    cancelBulkLayout();
+
+    QTextDocument *doc = document();
+    m_bulkLayoutJob.reset(new VBulkLayoutJob(++m_bulkLayoutGeneration,
+                                             p_firstBlock,
+                                             p_inputs,
+                                             doc->defaultTextOption(),
+                                             m_margin,
+                                             m_lineLeading),
+                          &QObject::deleteLater);
+    m_bulkLayoutPublishedChunks = 0;
+    connect(m_bulkLayoutJob.data(), &VBulkLayoutJob::chunkFinished,
+            this, &VTextDocumentLayout::publishBulkLayoutChunk);
+
+    VBulkLayoutJob::start(m_bulkLayoutJob, QThreadPool::globalInstance());
+}
+
+void VTextDocumentLayout::cancelBulkLayout()
+{
+    if (m_bulkLayoutJob.isNull()) {
+        return;
+    }
+
+    m_bulkLayoutJob->cancel();
+    disconnect(m_bulkLayoutJob.data(), 0, this, 0);
+    m_bulkLayoutJob.reset();
+}
+
+void VTextDocumentLayout::publishBulkLayoutChunk(int p_generation, int p_first, int p_count)
+{
+    V_TRACE_SPAN_ARG("publishBulkLayoutChunk", p_first);
+
+    if (m_bulkLayoutJob.isNull() || p_generation != m_bulkLayoutJob->generation()) {
+        // From a cancelled job.
+        return;
+    }
+
+    QTextBlock block = document()->findBlockByNumber(p_first);
+    for (int i = 0; i < p_count && block.isValid(); ++i, block = block.next()) {
+        int num = block.blockNumber();
+        if (m_blocks[num].hasRect()) {
+            // Already laid out on the GUI thread.
+            continue;
+        }
+
+        const VBulkLayoutJob::Result &res = m_bulkLayoutJob->result(num);
+        if (res.m_lineCount < 1) {
+            continue;
+        }
+
+        qint64 oldHeight = m_blocks.value(num);
+        qreal top = blockTop(num);
+
+        // The text layout of the block will be created when it is needed.
+        block.setLineCount(block.isVisible() ? res.m_lineCount : 0);
+        setBlockRect(num, blockRectFromLayoutGeometry(block,
+                                                      res.m_rect,
+                                                      res.m_lineCount,
+                                                      res.m_firstLineWidth));
+
+        handleLazyHeightChange(num, top, oldHeight);
+
+        V_STATS_ADD(m_stats, m_blocksMeasured, 1);
+    }
+
+    updateLayoutProgress();
+
+    if (++m_bulkLayoutPublishedChunks == m_bulkLayoutJob->chunkCount()) {
+        m_bulkLayoutJob.reset();
+
+        // Let background layout pick up the blocks left.
+        if (m_laidOutBlockCount < m_blocks.size()) {
+            m_layoutTimer->start();
+        }
+    }
+}
+
+const VLayoutStats &VTextDocumentLayout::stats() const
+{
+    return m_stats;
+}
+
+void VTextDocumentLayout::resetStats()
+{
+    m_stats.reset();
+}
+
+void VTextDocumentLayout::setParallelLayoutEnabled(bool p_enabled)
+{
+    m_parallelLayoutEnabled = p_enabled;
+    if (!m_parallelLayoutEnabled) {
+        cancelBulkLayout();
+    }
+}
+
+void VTextDocumentLayout::updateEstimationMetrics()
+{
+    QFontMetricsF fm(document()->defaultFont());
+    m_estimatedLineHeight = fm.lineSpacing();
+    m_estimatedCharWidth = fm.averageCharWidth();
+}
+
+qreal VTextDocumentLayout::estimateBlockHeight(const QTextBlock &p_block) const
+{
+    QTextDocument *doc = document();
+    qreal availableWidth = doc->pageSize().width();
     if (availableWidth <= 0) {
         availableWidth = qreal(INT_MAX);
     }
 
-    availableWidth -= (2 * m_margin + extraMargin + m_cursorMargin);
+    availableWidth -= (2 * m_margin + m_cursorMargin);
 
-    tl->beginLayout();
+    int lines = 1;
+    if (doc->defaultTextOption().wrapMode() != QTextOption::NoWrap
+        && availableWidth > 0) {
+        qreal textWidth = p_block.length() * m_estimatedCharWidth;
+        lines = qMax(1, qCeil(textWidth / availableWidth));
+    }
 
-    while (true) {
-        QTextLine line = tl->createLine();
-        if (!line.isValid()) {
-            break;
+    qreal height = lines * (m_estimatedLineHeight + m_lineLeading);
+
+    // Handle block image.
+    if (m_blockImageEnabled) {
+        const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(p_block.blockNumber());
+        if (info && !info->m_imageSize.isNull()) {
+            int padding;
+            QSize size;
+            adjustImagePaddingAndSize(info, availableWidth, padding, size);
+            height += size.height() + m_lineLeading;
         }
+    }
 
-        line.setLeadingIncluded(true);
-        line.setLineWidth(availableWidth);
-        height += m_lineLeading;
-        line.setPosition(QPointF(m_margin, height));
-        height += line.height();
+    // Add bottom margin.
+    if (!p_block.next().isValid()) {
+        height += m_margin;
     }
 
-    tl->endLayout();
+    return height;
+}
+
+void VTextDocumentLayout::setBlockRect(int p_blockNumber, const QRectF &p_rect)
+{
+    BlockInfo &info = m_blocks[p_blockNumber];
+    if (info.hasRect()) {
+        removeBlockWidth(info.m_rect.width());
+        --m_laidOutBlockCount;
+    }
+
+    info.m_rect = p_rect;
+    if (info.hasRect()) {
+        addBlockWidth(info.m_rect.width());
+        ++m_laidOutBlockCount;
+    }
+
+    setBlockHeight(p_blockNumber, p_rect.height());
+}
+
+void VTextDocumentLayout::addBlockWidth(qreal p_width)
+{
+    ++m_widths[p_width];
+}
+
+void VTextDocumentLayout::removeBlockWidth(qreal p_width)
+{
+    auto it = m_widths.find(p_width);
+    Q_ASSERT(it != m_widths.end());
+    if (--it.value() == 0) {
+        m_widths.erase(it);
+    }
+}
+
+qreal VTextDocumentLayout::maximumBlockWidth() const
+{
+    return m_widths.isEmpty() ? 0 : m_widths.lastKey();
+}
+
+void VTextDocumentLayout::updateBlockCount(int p_count, int p_changeStartBlock)
+{
+    if (m_blockCount == p_count) {
+        return;
+    }
+
+    int delta = p_count - m_blockCount;
+    m_blockCount = p_count;
+    V_STATS_ADD(m_stats, m_blockShifts, qAbs(delta));
+
+    // Blocks behind the changed ones keep their layout, so we just insert or
+    // remove entries right after the start block to keep them aligned.
+    int idx = qMin(p_changeStartBlock + 1, m_blocks.size());
+    if (delta > 0) {
+        m_blocks.insert(idx, delta);
+    } else {
+        Q_ASSERT(idx - delta <= m_blocks.size());
+        for (int i = idx; i < idx - delta; ++i) {
+            if (m_blocks[i].hasRect()) {
+                removeBlockWidth(m_blocks[i].m_rect.width());
+                --m_laidOutBlockCount;
+            }
+        }
+
+        m_blocks.remove(idx, -delta);
+    }
+
+    Q_ASSERT(m_blocks.size() == m_blockCount);
+}
+
+void VTextDocumentLayout::layoutBlock(const QTextBlock &p_block)
+{
+    V_STATS_TIME_SCOPE(m_stats, VLayoutStats::LayoutBlock);
+    V_TRACE_SPAN_ARG("layoutBlock", p_block.blockNumber());
+    V_STATS_ADD(m_stats, m_blocksLaidOut, 1);
+
+    QTextDocument *doc = document();
+    Q_ASSERT(m_margin == doc->documentMargin());
+
+    QTextLayout *tl = p_block.layout();
+    tl->setTextOption(doc->defaultTextOption());
+
+    layoutLines(tl,
+                availableLineWidth(p_block.charFormat().font()),
+                m_margin,
+                m_lineLeading);
 
     // Set this block's line count to its layout's line count.
     // That is one block may occupy multiple visual lines.
@@ -553,26 +1428,58 @@ void VTextDocumentLayout::layoutBlock(const QTextBlock &p_block)
     finishBlockLayout(p_block);
 }
 
+void VTextDocumentLayout::layoutLines(QTextLayout *p_tl,
+                                      qreal p_availableWidth,
+                                      qreal p_margin,
+                                      qreal p_leading)
+{
+    // The height (y) of the next line.
+    qreal height = 0;
+
+    p_tl->beginLayout();
+
+    while (true) {
+        QTextLine line = p_tl->createLine();
+        if (!line.isValid()) {
+            break;
+        }
+
+        line.setLeadingIncluded(true);
+        line.setLineWidth(p_availableWidth);
+        height += p_leading;
+        line.setPosition(QPointF(p_margin, height));
+        height += line.height();
+    }
+
+    p_tl->endLayout();
+}
+
+qreal VTextDocumentLayout::availableLineWidth(const QFont &p_font) const
+{
+    QTextDocument *doc = document();
+    int extraMargin = 0;
+    if (doc->defaultTextOption().flags() & QTextOption::AddSpaceForLineAndParagraphSeparators) {
+        QFontMetrics fm(p_font);
+        extraMargin += fm.width(QChar(0x21B5));
+    }
+
+    qreal availableWidth = doc->pageSize().width();
+    if (availableWidth <= 0) {
+        availableWidth = qreal(INT_MAX);
+    }
+
+    availableWidth -= (2 * m_margin + extraMargin + m_cursorMargin);
+    return availableWidth;
+}
+
 void VTextDocumentLayout::finishBlockLayout(const QTextBlock &p_block)
 {
     // Update rect and offset.
     Q_ASSERT(p_block.isValid());
     int num = p_block.blockNumber();
     Q_ASSERT(m_blocks.size() > num);
-    BlockInfo &info = m_blocks[num];
-    info.reset();
-    info.m_rect = blockRectFromTextLayout(p_block);
-    Q_ASSERT(!info.m_rect.isNull());
-    int pre = previousValidBlockNumber(num);
-    if (pre == -1) {
-        info.m_offset = 0;
-    } else if (m_blocks[pre].hasOffset()) {
-        info.m_offset = m_blocks[pre].bottom();
-    }
-
-    if (info.hasOffset()) {
-        fillOffsetFrom(num);
-    }
+    setBlockRect(num, blockRectFromTextLayout(p_block));
+    Q_ASSERT(m_blocks[num].hasRect());
 }
 
 int VTextDocumentLayout::previousValidBlockNumber(int p_number) const
@@ -593,29 +1500,17 @@ int VTextDocumentLayout::nextValidBlockNumber(int p_number) const
 
 void VTextDocumentLayout::updateDocumentSize()
 {
-    // The last valid block.
-    int idx = previousValidBlockNumber(m_blocks.size());
-    Q_ASSERT(idx > -1);
-    if (m_blocks[idx].hasOffset()) {
-        int oldHeight = m_height;
-        int oldWidth = m_width;
-
-        m_height = m_blocks[idx].bottom();
-
-        m_width = 0;
-        for (int i = 0; i < m_blocks.size(); ++i) {
-            const BlockInfo &info = m_blocks[i];
-            Q_ASSERT(info.hasOffset());
-            if (m_width < info.m_rect.width()) {
-                m_width = info.m_rect.width();
-                m_maximumWidthBlockNumber = i;
-            }
-        }
+    Q_ASSERT(!m_blocks.isEmpty());
+    int oldHeight = m_height;
+    int oldWidth = m_width;
 
-        if (oldHeight != m_height
-            || oldWidth != m_width) {
-            emit documentSizeChanged(documentSize());
-        }
+    m_height = fromFixedPoint(m_blocks.total());
+
+    m_width = maximumBlockWidth();
+
+    if (oldHeight != m_height
+        || oldWidth != m_width) {
+        emit documentSizeChanged(documentSize());
     }
 }
 
@@ -636,19 +1531,29 @@ QRectF VTextDocumentLayout::blockRectFromTextLayout(const QTextBlock &p_block)
         return QRectF();
     }
 
-    QRectF tlRect = tl->boundingRect();
-    QRectF br(QPointF(0, 0), tlRect.bottomRight());
+    return blockRectFromLayoutGeometry(p_block,
+                                       tl->boundingRect(),
+                                       tl->lineCount(),
+                                       tl->lineAt(0).naturalTextWidth());
+}
+
+QRectF VTextDocumentLayout::blockRectFromLayoutGeometry(const QTextBlock &p_block,
+                                                        const QRectF &p_tlRect,
+                                                        int p_lineCount,
+                                                        qreal p_firstLineWidth) const
+{
+    QRectF br(QPointF(0, 0), p_tlRect.bottomRight());
 
     // Do not know why. Copied from QPlainTextDocumentLayout.
-    if (tl->lineCount() == 1) {
-        br.setWidth(qMax(br.width(), tl->lineAt(0).naturalTextWidth()));
+    if (p_lineCount == 1) {
+        br.setWidth(qMax(br.width(), p_firstLineWidth));
     }
 
     // Handle block image.
     if (m_blockImageEnabled) {
         const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(p_block.blockNumber());
         if (info && !info->m_imageSize.isNull()) {
-            int maximumWidth = tlRect.width();
+            int maximumWidth = p_tlRect.width();
             int padding;
             QSize size;
             adjustImagePaddingAndSize(info, maximumWidth, padding, size);
@@ -668,17 +1573,12 @@ QRectF VTextDocumentLayout::blockRectFromTextLayout(const QTextBlock &p_block)
     return br;
 }
 
-void VTextDocumentLayout::updateDocumentSizeWithOneBlockChanged(int p_blockNumber)
+void VTextDocumentLayout::updateDocumentSizeWithOneBlockChanged()
 {
-    const BlockInfo &info = m_blocks[p_blockNumber];
-    qreal width = info.m_rect.width();
-    if (width > m_width) {
+    qreal width = maximumBlockWidth();
+    if (width != m_width) {
         m_width = width;
-        m_maximumWidthBlockNumber = p_blockNumber;
         emit documentSizeChanged(documentSize());
-    } else if (width < m_width && p_blockNumber == m_maximumWidthBlockNumber) {
-        // Shrink the longest block.
-        updateDocumentSize();
     }
 }
 
@@ -686,17 +1586,45 @@ void VTextDocumentLayout::setLineLeading(qreal p_leading)
 {
     if (p_leading >= 0) {
         m_lineLeading = p_leading;
+        m_rasterCache.clear();
     }
 }
 
 void VTextDocumentLayout::setImageWidthConstrainted(bool p_enabled)
 {
     m_imageWidthConstrainted = p_enabled;
+    m_rasterCache.clear();
 }
 
 void VTextDocumentLayout::setBlockImageEnabled(bool p_enabled)
 {
     m_blockImageEnabled = p_enabled;
+    m_rasterCache.clear();
+}
+
+void VTextDocumentLayout::setLazyLayoutEnabled(bool p_enabled)
+{
+    if (m_lazyLayoutEnabled == p_enabled) {
+        return;
+    }
+
+    m_lazyLayoutEnabled = p_enabled;
+    if (p_enabled) {
+        return;
+    }
+
+    // Edited blocks are expected to be laid out in non-lazy mode, so lay out
+    // the ones left with estimated heights at once.
+    m_layoutTimer->stop();
+    cancelBulkLayout();
+
+    QTextBlock block = document()->firstBlock();
+    while (block.isValid() && m_laidOutBlockCount < m_blocks.size()) {
+        ensureBlockLayout(block);
+        block = block.next();
+    }
+
+    updateLayoutProgress();
 }
 
 void VTextDocumentLayout::adjustImagePaddingAndSize(const VBlockImageInfo2 *p_info,
@@ -726,9 +1654,35 @@ void VTextDocumentLayout::adjustImagePaddingAndSize(const VBlockImageInfo2 *p_in
     }
 }
 
+QRect VTextDocumentLayout::blockImageRect(const QTextBlock &p_block,
+                                          const VBlockImageInfo2 *p_info,
+                                          const QPointF &p_offset) const
+{
+    QRectF tlRect = p_block.layout()->boundingRect();
+    int maximumWidth = tlRect.width();
+    int padding;
+    QSize size;
+    adjustImagePaddingAndSize(p_info, maximumWidth, padding, size);
+    return QRect(p_offset.x() + padding,
+                 p_offset.y() + tlRect.height() + m_lineLeading,
+                 size.width(),
+                 size.height());
+}
+
+bool VTextDocumentLayout::hasAnimatedImage(int p_blockNumber) const
+{
+    if (!m_blockImageEnabled) {
+        return false;
+    }
+
+    const VBlockImageInfo2 *info = m_imageMgr->findImageInfoByBlock(p_blockNumber);
+    return info && m_imageMgr->isAnimatedImage(info->m_imageHandle);
+}
+
 void VTextDocumentLayout::drawBlockImage(QPainter *p_painter,
                                          const QTextBlock &p_block,
-                                         const QPointF &p_offset)
+                                         const QPointF &p_offset,
+                                         const QRectF &p_clip)
 {
     if (!m_blockImageEnabled) {
         return;
@@ -739,20 +1693,50 @@ void VTextDocumentLayout::drawBlockImage(QPainter *p_painter,
         return;
     }
 
-    const QPixmap *image = m_imageMgr->findImage(info->m_imageName);
-    Q_ASSERT(image);
+    QRect targetRect = blockImageRect(p_block, info, p_offset);
+    QSize size = targetRect.size();
+
+    // Only the text of the block may be visible.
+    QRect rect = visibleImageRect(targetRect, p_clip);
+    if (rect.isEmpty()) {
+        return;
+    }
+
+    V_STATS_TIME_SCOPE(m_stats, VLayoutStats::DrawBlockImage);
+    V_TRACE_SPAN_ARG("drawBlockImage", p_block.blockNumber());
+    V_STATS_ADD(m_stats, m_imagesDrawn, 1);
+
+    const QPixmap *image = m_imageMgr->findImage(info->m_imageHandle);
+    if (!image) {
+        // Still being decoded.
+        return;
+    }
 
     // Draw block image.
-    QTextLayout *tl = p_block.layout();
-    QRectF tlRect = tl->boundingRect();
-    int maximumWidth = tlRect.width();
-    int padding;
-    QSize size;
-    adjustImagePaddingAndSize(info, maximumWidth, padding, size);
-    QRect targetRect(p_offset.x() + padding,
-                     p_offset.y() + tlRect.height() + m_lineLeading,
-                     size.width(),
-                     size.height());
+    if (size == image->size()) {
+        drawImagePart(p_painter, targetRect, rect, *image);
+        return;
+    }
 
-    p_painter->drawPixmap(targetRect, *image);
+    // Scaling the full image on every paint is expensive. Draw the variant
+    // scaled in advance, cutting the tiles within the clip for tall images, or
+    // a fast scaled one until it is ready.
+    // Images too large for the cache of scaled variants are drawn smoothly
+    // from the nearest level instead, only the tiles within the clip.
+    // So are animated images, whose frames change all the time.
+    qreal dpr = p_painter->device()->devicePixelRatioF();
+    bool direct = m_imageMgr->isAnimatedImage(info->m_imageHandle)
+                  || !m_imageMgr->isScaledImageCacheable(size, dpr);
+    const QPixmap *scaled = direct ? NULL
+                                   : m_imageMgr->findScaledImage(info->m_imageHandle, size, dpr);
+    if (scaled) {
+        drawImagePart(p_painter, targetRect, rect, *scaled);
+    } else {
+        // Draw from the nearest level of the image.
+        image = m_imageMgr->findImage(info->m_imageHandle, qCeil(size.width() * dpr));
+        bool smooth = p_painter->testRenderHint(QPainter::SmoothPixmapTransform);
+        p_painter->setRenderHint(QPainter::SmoothPixmapTransform, direct);
+        drawImagePart(p_painter, targetRect, rect, *image);
+        p_painter->setRenderHint(QPainter::SmoothPixmapTransform, smooth);
+    }
 }
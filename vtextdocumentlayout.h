@@ -4,9 +4,38 @@
 #include <QAbstractTextDocumentLayout>
 #include <QVector>
 #include <QSize>
+#include <QMap>
+#include <QRectF>
+#include <QCache>
+#include <QPixmap>
+
+#include "vblocktree.h"
+#include "vintervalindex.h"
+#include "vbulklayoutjob.h"
+#include "vlayoutstats.h"
 
 class VImageResourceManager2;
 struct VBlockImageInfo2;
+class QTimer;
+class QElapsedTimer;
+
+// Geometry of a block for painting alongside the text, such as line numbers.
+struct VBlockGeometry
+{
+    int m_blockNumber;
+
+    // Y offset of the top in document coordinates.
+    qreal m_top;
+
+    qreal m_height;
+
+    bool m_visible;
+
+    // 0 if the block has not been laid out.
+    int m_lineCount;
+
+    int m_userState;
+};
 
 
 class VTextDocumentLayout : public QAbstractTextDocumentLayout
@@ -16,6 +45,8 @@ public:
     VTextDocumentLayout(QTextDocument *p_doc,
                         VImageResourceManager2 *p_imageMgr);
 
+    ~VTextDocumentLayout();
+
     void draw(QPainter *p_painter, const PaintContext &p_context) Q_DECL_OVERRIDE;
 
     int hitTest(const QPointF &p_point, Qt::HitTestAccuracy p_accuracy) const Q_DECL_OVERRIDE;
@@ -40,14 +71,90 @@ public:
     // If @p_point is at the border, returns the block below.
     int findBlockByPosition(const QPointF &p_point) const;
 
+    // Return the geometry of the blocks within [@p_top, @p_bottom] in document
+    // coordinates in O(log n + k), sorted by block number.
+    // Blocks within the range are laid out on demand.
+    QVector<VBlockGeometry> blockGeometries(qreal p_top, qreal p_bottom);
+
     void setImageWidthConstrainted(bool p_enabled);
 
     void setBlockImageEnabled(bool p_enabled);
 
+    // In lazy layout mode, large changes do not lay out their blocks immediately.
+    // Those blocks get estimated heights from font metrics and are laid out
+    // on demand when they are drawn or queried.
+    // Turning it off lays out the blocks left at once.
+    // A relayout of the whole document without changing the text, such as a
+    // change of the wrap width, is always deferred like this except for the
+    // visible blocks.
+    void setLazyLayoutEnabled(bool p_enabled);
+
+    // Set the visible rect of the view in document coordinates.
+    // Background layout handles blocks around it first.
+    void setViewportRect(const QRectF &p_rect);
+
+    // Set the time budget in ms of each chunk of background layout.
+    void setLayoutTimeBudget(int p_ms);
+
+    // Percentage of blocks which have been laid out.
+    int layoutProgress() const;
+
+    // Only works for changes deferred by lazy layout mode or by a relayout.
+    // Large changes will be measured concurrently on the global thread pool
+    // instead of being laid out one by one in the background.
+    void setParallelLayoutEnabled(bool p_enabled);
+
+    // Cache the rendered pixmap of blocks to speed up scrolling.
+    // Blocks with selections are always drawn directly.
+    // Blocks are cached opaquely over the Base color of the palette.
+    void setRasterCacheEnabled(bool p_enabled);
+
+    // Memory limit of the raster cache. Least recently used blocks are evicted.
+    void setRasterCacheLimit(int p_bytes);
+
+    // Drop the cached pixmap of blocks from @p_fromBlock.
+    // Should be called when anything drawn other than the text changes, such as images.
+    void invalidateRasterCache(int p_fromBlock = 0);
+
+    // Update the geometry of blocks @p_blockNumbers whose image size changed and
+    // repaint them.
+    // Blocks behind are shifted, or the viewport is kept anchored if above it.
+    void relayoutBlocks(const QVector<int> &p_blockNumbers);
+
+    // Repaint blocks @p_blockNumbers whose image content changed.
+    void updateBlocks(const QVector<int> &p_blockNumbers);
+
+    // Repaint only the image area of blocks @p_blockNumbers, such as for a new
+    // frame of an animated image.
+    void updateBlockImageRects(const QVector<int> &p_blockNumbers);
+
+    // Performance counters since last resetStats().
+    const VLayoutStats &stats() const;
+
+    // Could be called per frame.
+    void resetStats();
+
+    // Create lines of @p_tl with the line width @p_availableWidth.
+    // Could be called in non-GUI threads.
+    static void layoutLines(QTextLayout *p_tl,
+                            qreal p_availableWidth,
+                            qreal p_margin,
+                            qreal p_leading);
+
+signals:
+    void layoutProgressChanged(int p_percent);
+
+    // Blocks above the viewport changed their heights by @p_dy in total
+    // after being laid out. The view should scroll by @p_dy to keep its
+    // contents still.
+    void contentShiftedAboveViewport(qreal p_dy);
+
 protected:
     void documentChanged(int p_from, int p_charsRemoved, int p_charsAdded) Q_DECL_OVERRIDE;
 
 private:
+    // A block without a rect has not been laid out yet. Its height in
+    // m_blocks is an estimation in lazy layout mode.
     struct BlockInfo
     {
         BlockInfo()
@@ -57,54 +164,101 @@ private:
 
         void reset()
         {
-            m_offset = -1;
             m_rect = QRectF();
         }
 
-        bool hasOffset() const
+        bool hasRect() const
         {
-            return m_offset > -1 && !m_rect.isNull();
+            return !m_rect.isNull();
         }
 
-        qreal top() const
-        {
-            Q_ASSERT(hasOffset());
-            return m_offset;
-        }
-
-        qreal bottom() const
-        {
-            Q_ASSERT(hasOffset());
-            return m_offset + m_rect.height();
-        }
-
-        // Y offset of this block.
-        // -1 for invalid.
-        qreal m_offset;
-
         // The bounding rect of this block, including the margins.
         // Null for invalid.
+        // The Y offset of this block is kept in m_blocks.
         QRectF m_rect;
     };
 
     void layoutBlock(const QTextBlock &p_block);
 
+    // Available width for the lines of a block with font @p_font.
+    qreal availableLineWidth(const QFont &p_font) const;
+
     // Clear the layout of @p_block.
-    // Also clear all the offset behind this block.
     void clearBlockLayout(QTextBlock &p_block);
 
-    // Clear the offset of all the blocks from @p_blockNumber.
-    void clearOffsetFrom(int p_blockNumber);
-
-    // Fill the offset filed from @p_blockNumber + 1.
-    void fillOffsetFrom(int p_blockNumber);
-
     // Update block count to @p_count due to document change.
-    // Maintain m_blocks.
-    // @p_changeStartBlock is the block number of the start block in this change.
+    // Maintain m_blocks by inserting or removing entries right after
+    // @p_changeStartBlock, which is the block number of the start block in
+    // this change.
     void updateBlockCount(int p_count, int p_changeStartBlock);
 
-    bool validateBlocks() const;
+    // Y offset of the top of block @p_blockNumber.
+    qreal blockTop(int p_blockNumber) const;
+
+    // Y offset of the bottom of block @p_blockNumber.
+    qreal blockBottom(int p_blockNumber) const;
+
+    // Update the height of block @p_blockNumber in m_blocks.
+    void setBlockHeight(int p_blockNumber, qreal p_height);
+
+    // Lay out @p_block if it only has an estimated height or its text layout
+    // has not been created.
+    void ensureBlockLayout(const QTextBlock &p_block);
+
+    bool isBlockLaidOut(const QTextBlock &p_block) const;
+
+    // Update the view after the height of block @p_blockNumber, whose top is
+    // @p_top, changed from @p_oldHeight by on-demand layout.
+    void handleLazyHeightChange(int p_blockNumber, qreal p_top, qint64 p_oldHeight);
+
+    // Lay out all the blocks within @p_rect which only have estimated heights.
+    void layoutBlocksInRect(const QRectF &p_rect);
+
+    // Update document size and the view after blocks have been laid out on demand.
+    // @p_top: the Y offset from which the blocks are shifted; -1 if none.
+    void scheduleLazyUpdate(qreal p_top);
+
+    void finishLazyUpdate();
+
+    // Update the view of the blocks shifted from Y offset @p_top.
+    // Only the part within the viewport is updated if it is known, since
+    // the rest will be drawn when scrolled into the viewport.
+    void updateShiftedBlocks(qreal p_top);
+
+    // Lay out blocks only having estimated heights in a chunk bounded by
+    // m_layoutTimeBudget. Reschedule itself if there are blocks left.
+    void layoutInBackground();
+
+    // Return false if the budget is used up before finishing.
+    bool layoutBlocksInRectWithinBudget(const QRectF &p_rect, const QElapsedTimer &p_timer);
+
+    bool layoutRestWithinBudget(const QElapsedTimer &p_timer);
+
+    void updateLayoutProgress();
+
+    // Measure the blocks from @p_firstBlock concurrently.
+    void startBulkLayout(int p_firstBlock, QVector<VBulkLayoutJob::Input> &p_inputs);
+
+    void cancelBulkLayout();
+
+    // Publish results of blocks [@p_first, @p_first + @p_count) from bulk
+    // layout job @p_generation to m_blocks.
+    void publishBulkLayoutChunk(int p_generation, int p_first, int p_count);
+
+    void updateEstimationMetrics();
+
+    // Estimate the height of @p_block without laying it out.
+    qreal estimateBlockHeight(const QTextBlock &p_block) const;
+
+    // Set the rect of block @p_blockNumber and maintain m_blocks and m_widths.
+    void setBlockRect(int p_blockNumber, const QRectF &p_rect);
+
+    void addBlockWidth(qreal p_width);
+
+    void removeBlockWidth(qreal p_width);
+
+    // Maximum width of all the blocks in O(log n).
+    qreal maximumBlockWidth() const;
 
     void finishBlockLayout(const QTextBlock &p_block);
 
@@ -115,9 +269,16 @@ private:
     // Update block count and m_blocks size.
     void updateDocumentSize();
 
+    // Ranges of @p_selections within @p_block.
+    // updateSelectionIndex() should be called with @p_selections first.
     QVector<QTextLayout::FormatRange> formatRangeFromSelection(const QTextBlock &p_block,
                                                                const QVector<Selection> &p_selections) const;
 
+    // Index @p_selections by position if they differ from the indexed ones.
+    // Selections appended behind the indexed ones, such as the one of the
+    // cursor, are scanned linearly unless there are too many of them.
+    void updateSelectionIndex(const QVector<Selection> &p_selections);
+
     // Get the block range [first, last] by rect @p_rect.
     // @p_rect: a clip region in document coordinates. If null, returns all the blocks.
     // Return [-1, -1] if no valid block range found.
@@ -130,20 +291,49 @@ private:
     // Return a null rect if @p_block has not been layouted.
     QRectF blockRectFromTextLayout(const QTextBlock &p_block);
 
-    // Update document size when only block @p_blockNumber is changed and the height
+    // Return a rect from the geometry of the text layout of @p_block.
+    // @p_tlRect: the bounding rect of the text layout.
+    // @p_firstLineWidth: the natural text width of the first line.
+    QRectF blockRectFromLayoutGeometry(const QTextBlock &p_block,
+                                       const QRectF &p_tlRect,
+                                       int p_lineCount,
+                                       qreal p_firstLineWidth) const;
+
+    // Update document size when only one block is changed and the height
     // remain the same.
-    void updateDocumentSizeWithOneBlockChanged(int p_blockNumber);
+    void updateDocumentSizeWithOneBlockChanged();
 
     void adjustImagePaddingAndSize(const VBlockImageInfo2 *p_info,
                                    int p_maximumWidth,
                                    int &p_padding,
                                    QSize &p_size) const;
 
+    // Rect of the image of block @p_block with info @p_info drawn at @p_offset.
+    QRect blockImageRect(const QTextBlock &p_block,
+                         const VBlockImageInfo2 *p_info,
+                         const QPointF &p_offset) const;
+
+    // Whether block @p_blockNumber has an animated image.
+    bool hasAnimatedImage(int p_blockNumber) const;
+
+    // Tell the image manager which images are near the viewport.
+    void updateActiveImages(const QRectF &p_clip);
+
+    // Draw @p_block from the raster cache, rendering it first if needed.
+    // Return false if @p_block could not be cached.
+    bool drawBlockFromCache(QPainter *p_painter,
+                            const QTextBlock &p_block,
+                            const QPointF &p_offset,
+                            const QPalette &p_palette);
+
     // Draw images of block @p_block.
     // @p_offset: the offset for the drawing of the block.
+    // @p_clip: only the part of the image within it is drawn. Invalid to draw
+    // the whole image.
     void drawBlockImage(QPainter *p_painter,
                         const QTextBlock &p_block,
-                        const QPointF &p_offset);
+                        const QPointF &p_offset,
+                        const QRectF &p_clip);
 
     // Document margin on left/right/bottom.
     qreal m_margin;
@@ -151,8 +341,10 @@ private:
     // Maximum width of the contents.
     qreal m_width;
 
-    // The block number of the block which contains the m_width.
-    int m_maximumWidthBlockNumber;
+    // Width histogram of all the blocks with a valid rect.
+    // Maps a block width to the number of blocks with that width, so the
+    // maximum width is the last key.
+    QMap<qreal, int> m_widths;
 
     // Height of all the document (all the blocks).
     qreal m_height;
@@ -169,7 +361,9 @@ private:
     // Right margin for cursor.
     qreal m_cursorMargin;
 
-    QVector<BlockInfo> m_blocks;
+    // Info and heights in fixed point of all the blocks, indexed by block
+    // number. The prefix sum of the heights gives the Y offset of a block.
+    VBlockTree<BlockInfo> m_blocks;
 
     VImageResourceManager2 *m_imageMgr;
 
@@ -177,6 +371,95 @@ private:
 
     // Whether constraint the width of image to the width of the page.
     bool m_imageWidthConstrainted;
+
+    bool m_lazyLayoutEnabled;
+
+    // Font metrics used to estimate the height of blocks not laid out yet.
+    qreal m_estimatedLineHeight;
+
+    qreal m_estimatedCharWidth;
+
+    // Whether finishLazyUpdate() has been scheduled.
+    bool m_lazyUpdatePending;
+
+    // The minimum Y offset of blocks shifted by on-demand layout; -1 if none.
+    qreal m_lazyUpdateTop;
+
+    // Height changes of blocks above the viewport by on-demand layout.
+    qreal m_lazyAnchorShift;
+
+    // Number of blocks with a valid rect.
+    int m_laidOutBlockCount;
+
+    // Visible rect of the view in document coordinates.
+    QRectF m_viewportRect;
+
+    // Timer to trigger background layout.
+    QTimer *m_layoutTimer;
+
+    // In ms.
+    int m_layoutTimeBudget;
+
+    // Background layout of the rest blocks goes on from this block.
+    int m_backgroundLayoutCursor;
+
+    // Last emitted layout progress.
+    int m_layoutProgress;
+
+    bool m_parallelLayoutEnabled;
+
+    QSharedPointer<VBulkLayoutJob> m_bulkLayoutJob;
+
+    // Number of chunks of m_bulkLayoutJob which have been published.
+    int m_bulkLayoutPublishedChunks;
+
+    // Generation of the last bulk layout job started.
+    int m_bulkLayoutGeneration;
+
+    // Whether it is in layoutInBackground().
+    bool m_inBackgroundLayout;
+
+    VLayoutStats m_stats;
+
+    // Rendered pixmap of a block.
+    struct RasterCacheEntry
+    {
+        QPixmap m_pixmap;
+
+        // Keys to check whether the pixmap is still valid.
+        int m_revision;
+
+        QSizeF m_size;
+
+        qint64 m_paletteKey;
+
+        qreal m_devicePixelRatio;
+    };
+
+    // Position range of a selection, which is [start, end).
+    struct SelectionRange
+    {
+        int m_start;
+
+        int m_end;
+    };
+
+    // Ranges of the selections indexed by m_selectionIndex, in their order.
+    QVector<SelectionRange> m_selectionRanges;
+
+    // Position range to the index of the selection.
+    VIntervalIndex m_selectionIndex;
+
+    // Selections checked against the index last, sharing their data.
+    QVector<Selection> m_checkedSelections;
+
+    // False if the text changed since m_checkedSelections was checked.
+    bool m_selectionIndexValid;
+
+    bool m_rasterCacheEnabled;
+
+    // Block number to its rendered pixmap. The cost is in KB.
+    QCache<int, RasterCacheEntry> m_rasterCache;
 };
 
 inline qreal VTextDocumentLayout::getLineLeading() const
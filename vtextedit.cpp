@@ -2,11 +2,16 @@
 
 #include <QDebug>
 #include <QScrollBar>
+#include <QGuiApplication>
+#include <QInputMethod>
 #include <QPainter>
 #include <QResizeEvent>
+#include <QtMath>
 
 #include "vtextdocumentlayout.h"
 #include "vimageresourcemanager2.h"
+#include "vcodeblockindex.h"
+#include "vtracer.h"
 
 
 enum class BlockState
@@ -21,14 +26,16 @@ enum class BlockState
 
 VTextEdit::VTextEdit(QWidget *p_parent)
     : QTextEdit(p_parent),
-      m_imageMgr(nullptr)
+      m_imageMgr(nullptr),
+      m_codeBlockIndex(nullptr)
 {
     init();
 }
 
 VTextEdit::VTextEdit(const QString &p_text, QWidget *p_parent)
     : QTextEdit(p_text, p_parent),
-      m_imageMgr(nullptr)
+      m_imageMgr(nullptr),
+      m_codeBlockIndex(nullptr)
 {
     init();
 }
@@ -38,6 +45,10 @@ VTextEdit::~VTextEdit()
     if (m_imageMgr) {
         delete m_imageMgr;
     }
+
+    if (m_codeBlockIndex) {
+        delete m_codeBlockIndex;
+    }
 }
 
 void VTextEdit::init()
@@ -46,6 +57,12 @@ void VTextEdit::init()
 
     m_blockImageEnabled = false;
 
+    m_anchoringViewport = false;
+
+    m_anchorRemainder = 0;
+
+    m_cursorBlockNumber = -1;
+
     m_imageMgr = new VImageResourceManager2();
 
     QTextDocument *doc = document();
@@ -53,6 +70,12 @@ void VTextEdit::init()
     docLayout->setBlockImageEnabled(m_blockImageEnabled);
     doc->setDocumentLayout(docLayout);
 
+    m_codeBlockIndex = new VCodeBlockIndex(doc,
+                                           (int)BlockState::CodeBlockStart,
+                                           (int)BlockState::CodeBlockEnd);
+    connect(doc, &QTextDocument::contentsChange,
+            this, &VTextEdit::updateCodeBlockIndex);
+
     m_lineNumberArea = new VLineNumberArea(this,
                                            document(),
                                            fontMetrics().width(QLatin1Char('8')),
@@ -65,7 +88,20 @@ void VTextEdit::init()
     connect(verticalScrollBar(), &QScrollBar::valueChanged,
             this, &VTextEdit::updateLineNumberArea);
     connect(this, &QTextEdit::cursorPositionChanged,
-            this, &VTextEdit::updateLineNumberArea);
+            this, &VTextEdit::updateLineNumberAreaOfCursor);
+
+    connect(docLayout, &VTextDocumentLayout::layoutProgressChanged,
+            this, &VTextEdit::layoutProgressChanged);
+    connect(docLayout, &VTextDocumentLayout::contentShiftedAboveViewport,
+            this, &VTextEdit::anchorViewport);
+    connect(verticalScrollBar(), &QScrollBar::valueChanged,
+            this, &VTextEdit::updateLayoutViewport);
+    connect(m_imageMgr, &VImageResourceManager2::imageUpdated,
+            this, &VTextEdit::handleImageUpdated);
+    connect(m_imageMgr, &VImageResourceManager2::imageSizeChanged,
+            this, &VTextEdit::handleImageSizeChanged);
+    connect(m_imageMgr, &VImageResourceManager2::imageFrameChanged,
+            this, &VTextEdit::handleImageFrameChanged);
 }
 
 VTextDocumentLayout *VTextEdit::getLayout() const
@@ -82,6 +118,8 @@ void VTextEdit::resizeEvent(QResizeEvent *p_event)
 {
     QTextEdit::resizeEvent(p_event);
 
+    updateLayoutViewport();
+
     if (m_lineNumberType != LineNumberType::None) {
         QRect rect = contentsRect();
         m_lineNumberArea->setGeometry(QRect(rect.left(),
@@ -93,40 +131,34 @@ void VTextEdit::resizeEvent(QResizeEvent *p_event)
 
 void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
 {
+    V_TRACE_SPAN("paintLineNumberArea");
+
     if (m_lineNumberType == LineNumberType::None) {
         updateLineNumberAreaMargin();
         m_lineNumberArea->hide();
         return;
     }
 
-    QPainter painter(m_lineNumberArea);
-    painter.fillRect(p_event->rect(), m_lineNumberArea->getBackgroundColor());
-
-    QTextBlock block = firstVisibleBlock();
-    if (!block.isValid()) {
-        return;
-    }
+    // Rows of the whole area are collected, while only the changed ones are
+    // drawn.
+    QVector<VLineNumberArea::Row> rows;
+    int offset = contentOffsetY();
 
     VTextDocumentLayout *layout = getLayout();
     Q_ASSERT(layout);
 
-    int blockNumber = block.blockNumber();
-    QRectF rect = layout->blockBoundingRect(block);
-    int top = contentOffsetY() + (int)rect.y();
-    int bottom = top + (int)rect.height();
-    int eventTop = p_event->rect().top();
-    int eventBtm = p_event->rect().bottom();
-    const int digitHeight = m_lineNumberArea->getDigitHeight();
+    int areaBtm = m_lineNumberArea->height();
+    const QVector<VBlockGeometry> geos = layout->blockGeometries(-offset, areaBtm - offset);
     const int curBlockNumber = textCursor().block().blockNumber();
-    painter.setPen(m_lineNumberArea->getForegroundColor());
     const int leading = (int)layout->getLineLeading();
 
+    VLineNumberArea::Row row;
+
     // Display line number only in code block.
     if (m_lineNumberType == LineNumberType::CodeBlock) {
         int number = 0;
-        while (block.isValid() && top <= eventBtm) {
-            int blockState = block.userState();
-            switch (blockState) {
+        for (auto const &geo : geos) {
+            switch (geo.m_userState) {
             case (int)BlockState::CodeBlockStart:
                 Q_ASSERT(number == 0);
                 number = 1;
@@ -139,14 +171,9 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
             case (int)BlockState::CodeBlock:
                 if (number == 0) {
                     // Need to find current line number in code block.
-                    QTextBlock startBlock = block.previous();
-                    while (startBlock.isValid()) {
-                        if (startBlock.userState() == (int)BlockState::CodeBlockStart) {
-                            number = block.blockNumber() - startBlock.blockNumber();
-                            break;
-                        }
-
-                        startBlock = startBlock.previous();
+                    int startBlock = m_codeBlockIndex->findCodeBlockStart(geo.m_blockNumber);
+                    if (startBlock > -1) {
+                        number = geo.m_blockNumber - startBlock;
                     }
                 }
 
@@ -156,74 +183,58 @@ void VTextEdit::paintLineNumberArea(QPaintEvent *p_event)
                 break;
             }
 
-            if (blockState == (int)BlockState::CodeBlock) {
-                if (block.isVisible() && bottom >= eventTop) {
-                    QString numberStr = QString::number(number);
-                    painter.drawText(0,
-                                     top + leading,
-                                     m_lineNumberArea->width(),
-                                     digitHeight,
-                                     Qt::AlignRight,
-                                     numberStr);
+            if (geo.m_userState == (int)BlockState::CodeBlock) {
+                if (geo.m_visible) {
+                    row.m_top = offset + (int)geo.m_top + leading;
+                    row.m_number = number;
+                    row.m_bold = false;
+                    rows.append(row);
                 }
 
                 ++number;
             }
-
-            block = block.next();
-            top = bottom;
-            bottom = top + (int)layout->blockBoundingRect(block).height();
         }
 
+        m_lineNumberArea->paintRows(p_event->rect(), rows, offset);
         return;
     }
 
     // Handle m_lineNumberType 1 and 2.
     Q_ASSERT(m_lineNumberType == LineNumberType::Absolute
              || m_lineNumberType == LineNumberType::Relative);
-    while (block.isValid() && top <= eventBtm) {
-        if (block.isVisible() && bottom >= eventTop) {
-            bool currentLine = false;
-            int number = blockNumber + 1;
-            if (m_lineNumberType == LineNumberType::Relative) {
-                number = blockNumber - curBlockNumber;
-                if (number == 0) {
-                    currentLine = true;
-                    number = blockNumber + 1;
-                } else if (number < 0) {
-                    number = -number;
-                }
-            } else if (blockNumber == curBlockNumber) {
-                currentLine = true;
-            }
-
-            QString numberStr = QString::number(number);
-
-            if (currentLine) {
-                QFont font = painter.font();
-                font.setBold(true);
-                painter.setFont(font);
-            }
+    for (auto const &geo : geos) {
+        if (!geo.m_visible) {
+            continue;
+        }
 
-            painter.drawText(0,
-                             top + leading,
-                             m_lineNumberArea->width(),
-                             digitHeight,
-                             Qt::AlignRight,
-                             numberStr);
-
-            if (currentLine) {
-                QFont font = painter.font();
-                font.setBold(false);
-                painter.setFont(font);
+        int blockNumber = geo.m_blockNumber;
+        bool currentLine = false;
+        int number = blockNumber + 1;
+        if (m_lineNumberType == LineNumberType::Relative) {
+            number = blockNumber - curBlockNumber;
+            if (number == 0) {
+                currentLine = true;
+                number = blockNumber + 1;
+            } else if (number < 0) {
+                number = -number;
             }
+        } else if (blockNumber == curBlockNumber) {
+            currentLine = true;
         }
 
-        block = block.next();
-        top = bottom;
-        bottom = top + (int)layout->blockBoundingRect(block).height();
-        ++blockNumber;
+        row.m_top = offset + (int)geo.m_top + leading;
+        row.m_number = number;
+        row.m_bold = currentLine;
+        rows.append(row);
     }
+
+    m_lineNumberArea->paintRows(p_event->rect(), rows, offset);
+}
+
+void VTextEdit::setLineNumberReservedDigits(int p_digits)
+{
+    m_lineNumberArea->setReservedDigits(p_digits);
+    updateLineNumberAreaMargin();
 }
 
 void VTextEdit::updateLineNumberAreaMargin()
@@ -235,6 +246,11 @@ void VTextEdit::updateLineNumberAreaMargin()
 
     if (width != viewportMargins().left()) {
         setViewportMargins(width, 0, 0, 0);
+
+        if (width > 0) {
+            QRect rect = contentsRect();
+            m_lineNumberArea->setGeometry(QRect(rect.left(), rect.top(), width, rect.height()));
+        }
     }
 }
 
@@ -253,6 +269,47 @@ void VTextEdit::updateLineNumberArea()
     }
 }
 
+void VTextEdit::updateLineNumberAreaOfCursor()
+{
+    int blockNumber = textCursor().block().blockNumber();
+    int oldBlockNumber = m_cursorBlockNumber;
+    m_cursorBlockNumber = blockNumber;
+
+    if (m_lineNumberType == LineNumberType::None || !m_lineNumberArea->isVisible()) {
+        updateLineNumberArea();
+        return;
+    }
+
+    // Line numbers do not depend on the cursor within a block.
+    if (blockNumber == oldBlockNumber
+        || m_lineNumberType == LineNumberType::CodeBlock) {
+        return;
+    }
+
+    if (m_lineNumberType == LineNumberType::Relative) {
+        m_lineNumberArea->update();
+        return;
+    }
+
+    // Only the emphasis of the old and new current lines changes.
+    updateLineNumberRow(oldBlockNumber);
+    updateLineNumberRow(blockNumber);
+}
+
+void VTextEdit::updateLineNumberRow(int p_blockNumber)
+{
+    QTextBlock block = document()->findBlockByNumber(p_blockNumber);
+    if (!block.isValid()) {
+        return;
+    }
+
+    QRectF rect = getLayout()->blockBoundingRect(block);
+    m_lineNumberArea->update(0,
+                             contentOffsetY() + (int)rect.y(),
+                             m_lineNumberArea->width(),
+                             qCeil(rect.height()));
+}
+
 QTextBlock VTextEdit::firstVisibleBlock() const
 {
     VTextDocumentLayout *layout = getLayout();
@@ -270,13 +327,56 @@ int VTextEdit::contentOffsetY() const
 void VTextEdit::updateBlockImages(const QVector<VBlockImageInfo2> &p_blocksInfo)
 {
     if (m_blockImageEnabled) {
-        m_imageMgr->updateBlockInfos(p_blocksInfo);
+        QVector<int> changedBlocks = m_imageMgr->updateBlockInfos(p_blocksInfo);
+        VTextDocumentLayout *layout = getLayout();
+        layout->invalidateRasterCache();
+        layout->relayoutBlocks(changedBlocks);
     }
 }
 
+void VTextEdit::updateBlockImages(const QVector<VBlockImageInfo2> &p_updatedBlocksInfo,
+                                  const QVector<int> &p_removedBlocks)
+{
+    if (!m_blockImageEnabled) {
+        return;
+    }
+
+    QVector<int> changedBlocks;
+    QVector<int> updatedBlocks;
+    for (auto const & info : p_updatedBlocksInfo) {
+        if (m_imageMgr->setBlockInfo(info)) {
+            changedBlocks.append(info.m_blockNumber);
+        } else {
+            // The image may be changed.
+            updatedBlocks.append(info.m_blockNumber);
+        }
+    }
+
+    for (int num : p_removedBlocks) {
+        if (m_imageMgr->removeBlockInfo(num)) {
+            changedBlocks.append(num);
+        }
+    }
+
+    VTextDocumentLayout *layout = getLayout();
+    layout->updateBlocks(updatedBlocks);
+    layout->relayoutBlocks(changedBlocks);
+}
+
+void VTextEdit::setBlockImage(const VBlockImageInfo2 &p_info)
+{
+    updateBlockImages(QVector<VBlockImageInfo2>() << p_info, QVector<int>());
+}
+
+void VTextEdit::removeBlockImage(int p_blockNumber)
+{
+    updateBlockImages(QVector<VBlockImageInfo2>(), QVector<int>() << p_blockNumber);
+}
+
 void VTextEdit::clearBlockImages()
 {
     m_imageMgr->clear();
+    getLayout()->invalidateRasterCache();
 }
 
 bool VTextEdit::containsImage(const QString &p_imageName) const
@@ -288,7 +388,45 @@ void VTextEdit::addImage(const QString &p_imageName, const QPixmap &p_image)
 {
     if (m_blockImageEnabled) {
         m_imageMgr->addImage(p_imageName, p_image);
+        getLayout()->invalidateRasterCache();
+    }
+}
+
+bool VTextEdit::addImageFromFile(const QString &p_imageName, const QString &p_filePath)
+{
+    if (m_blockImageEnabled) {
+        return m_imageMgr->addImageFromFile(p_imageName, p_filePath);
     }
+
+    return false;
+}
+
+bool VTextEdit::addImageFromData(const QString &p_imageName, const QByteArray &p_data)
+{
+    if (m_blockImageEnabled) {
+        return m_imageMgr->addImageFromData(p_imageName, p_data);
+    }
+
+    return false;
+}
+
+bool VTextEdit::addImageFromDataUrl(const QString &p_imageName, const QString &p_dataUrl)
+{
+    if (m_blockImageEnabled) {
+        return m_imageMgr->addImageFromDataUrl(p_imageName, p_dataUrl);
+    }
+
+    return false;
+}
+
+void VTextEdit::setImageMemoryLimit(qint64 p_bytes)
+{
+    m_imageMgr->setImageMemoryLimit(p_bytes);
+}
+
+void VTextEdit::setMaximumImageDecodeWidth(int p_width)
+{
+    m_imageMgr->setMaximumDecodeWidth(p_width);
 }
 
 void VTextEdit::setBlockImageEnabled(bool p_enabled)
@@ -310,3 +448,85 @@ void VTextEdit::setImageWidthConstrainted(bool p_enabled)
 {
     getLayout()->setImageWidthConstrainted(p_enabled);
 }
+
+void VTextEdit::setLazyLayoutEnabled(bool p_enabled)
+{
+    getLayout()->setLazyLayoutEnabled(p_enabled);
+}
+
+void VTextEdit::setParallelLayoutEnabled(bool p_enabled)
+{
+    getLayout()->setParallelLayoutEnabled(p_enabled);
+}
+
+void VTextEdit::setRasterCacheEnabled(bool p_enabled)
+{
+    getLayout()->setRasterCacheEnabled(p_enabled);
+    viewport()->update();
+}
+
+void VTextEdit::setLayoutTimeBudget(int p_ms)
+{
+    getLayout()->setLayoutTimeBudget(p_ms);
+}
+
+int VTextEdit::layoutProgress() const
+{
+    return getLayout()->layoutProgress();
+}
+
+void VTextEdit::updateLayoutViewport()
+{
+    QRect rect = viewport()->rect();
+    getLayout()->setViewportRect(QRectF(0,
+                                        -contentOffsetY(),
+                                        rect.width(),
+                                        rect.height()));
+}
+
+void VTextEdit::handleImageUpdated(const QString &p_imageName)
+{
+    getLayout()->updateBlocks(m_imageMgr->findBlocksByImage(p_imageName));
+}
+
+void VTextEdit::handleImageSizeChanged(const QString &p_imageName)
+{
+    getLayout()->relayoutBlocks(m_imageMgr->findBlocksByImage(p_imageName));
+}
+
+void VTextEdit::updateCodeBlockIndex(int p_position, int p_charsRemoved, int p_charsAdded)
+{
+    m_codeBlockIndex->contentsChange(p_position, p_charsRemoved, p_charsAdded);
+}
+
+void VTextEdit::handleImageFrameChanged(const QString &p_imageName)
+{
+    getLayout()->updateBlockImageRects(m_imageMgr->findBlocksByImage(p_imageName));
+}
+
+void VTextEdit::anchorViewport(qreal p_dy)
+{
+    // The layout has shifted its viewport rect by the exact amount, so carry
+    // the fraction to the next anchoring to avoid drifting.
+    qreal dy = p_dy + m_anchorRemainder;
+    int step = qRound(dy);
+    m_anchorRemainder = dy - step;
+
+    QScrollBar *sb = verticalScrollBar();
+    m_anchoringViewport = true;
+    sb->setValue(sb->value() + step);
+    m_anchoringViewport = false;
+}
+
+void VTextEdit::scrollContentsBy(int p_dx, int p_dy)
+{
+    if (m_anchoringViewport) {
+        // The contents shifted by the layout are already where they were in
+        // the viewport, so there is nothing to blit or repaint. The cursor
+        // still moved in the widget, as QTextEdit tells the input method.
+        QGuiApplication::inputMethod()->update(Qt::ImCursorRectangle | Qt::ImAnchorRectangle);
+        return;
+    }
+
+    QTextEdit::scrollContentsBy(p_dx, p_dy);
+}
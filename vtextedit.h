@@ -10,6 +10,7 @@ class VTextDocumentLayout;
 class QPainter;
 class QResizeEvent;
 class VImageResourceManager2;
+class VCodeBlockIndex;
 
 
 struct VBlockImageInfo2
@@ -20,7 +21,8 @@ public:
           m_startPos(-1),
           m_endPos(-1),
           m_padding(0),
-          m_inlineImage(false)
+          m_inlineImage(false),
+          m_imageHandle(-1)
     {
     }
 
@@ -35,7 +37,8 @@ public:
           m_endPos(p_endPos),
           m_padding(p_padding),
           m_inlineImage(p_inlineImage),
-          m_imageName(p_imageName)
+          m_imageName(p_imageName),
+          m_imageHandle(-1)
     {
     }
 
@@ -57,10 +60,17 @@ public:
     // The name of the image corresponding to this block.
     QString m_imageName;
 
+    // Declared size of the image, such as the one given in the link.
+    // Space of this size is reserved for the image until it is added.
+    QSize m_declaredSize;
+
 private:
     // For cache only.
     QSize m_imageSize;
 
+    // Handle of the image in VImageResourceManager2.
+    int m_imageHandle;
+
     friend class VImageResourceManager2;
     friend class VTextDocumentLayout;
 };
@@ -86,12 +96,28 @@ public:
 
     void setLineNumberColor(const QColor &p_foreground, const QColor &p_background);
 
+    // Reserve the width of the line number area for @p_digits digits up front.
+    // A wider area narrows the text, which wraps all the blocks again, so it is
+    // better to reserve enough digits for large documents.
+    void setLineNumberReservedDigits(int p_digits);
+
     QTextBlock firstVisibleBlock() const;
 
     // Update images of these given blocks.
     // Images of blocks not given here will be clear.
     void updateBlockImages(const QVector<VBlockImageInfo2> &p_blocksInfo);
 
+    // Update images of some blocks only. Other blocks are not touched.
+    // Only blocks whose geometry changed are laid out again.
+    // @p_updatedBlocksInfo: new or changed image info of blocks.
+    // @p_removedBlocks: numbers of blocks no longer having image.
+    void updateBlockImages(const QVector<VBlockImageInfo2> &p_updatedBlocksInfo,
+                           const QVector<int> &p_removedBlocks);
+
+    void setBlockImage(const VBlockImageInfo2 &p_info);
+
+    void removeBlockImage(int p_blockNumber);
+
     void clearBlockImages();
 
     // Whether the resoruce manager contains image of name @p_imageName.
@@ -100,32 +126,105 @@ public:
     // Add an image to the resources.
     void addImage(const QString &p_imageName, const QPixmap &p_image);
 
+    // Add an image to be decoded in the background.
+    // Blocks with it are laid out with the size from the image header at once
+    // and repainted once it is decoded.
+    bool addImageFromFile(const QString &p_imageName, const QString &p_filePath);
+
+    bool addImageFromData(const QString &p_imageName, const QByteArray &p_data);
+
+    // @p_dataUrl: such as "data:image/png;base64,...".
+    bool addImageFromDataUrl(const QString &p_imageName, const QString &p_dataUrl);
+
+    // Memory limit of decoded images. Images far from the viewport are evicted
+    // and decoded again when needed.
+    void setImageMemoryLimit(qint64 p_bytes);
+
+    // Decode images added from files or data at most @p_width pixels wide.
+    // Useful with image width constrained, where images are never shown wider
+    // than the viewport. 0 to decode at the original size.
+    void setMaximumImageDecodeWidth(int p_width);
+
     void setBlockImageEnabled(bool p_enabled);
 
     void setImageWidthConstrainted(bool p_enabled);
 
+    void setLazyLayoutEnabled(bool p_enabled);
+
+    void setParallelLayoutEnabled(bool p_enabled);
+
+    // Cache rendered blocks to speed up scrolling.
+    void setRasterCacheEnabled(bool p_enabled);
+
+    // Set the time budget in ms of each chunk of background layout.
+    void setLayoutTimeBudget(int p_ms);
+
+    // Percentage of blocks which have been laid out.
+    int layoutProgress() const;
+
+signals:
+    void layoutProgressChanged(int p_percent);
+
 protected:
     void resizeEvent(QResizeEvent *p_event) Q_DECL_OVERRIDE;
 
+    void scrollContentsBy(int p_dx, int p_dy) Q_DECL_OVERRIDE;
+
 private slots:
     // Update viewport margin to hold the line number area.
     void updateLineNumberAreaMargin();
 
     void updateLineNumberArea();
 
+    // Update the line numbers affected by the move of the cursor.
+    void updateLineNumberAreaOfCursor();
+
+    // Tell the layout the visible rect of the viewport.
+    void updateLayoutViewport();
+
+    // Repaint blocks with the images which become ready.
+    void handleImageUpdated(const QString &p_imageName);
+
+    // Relayout blocks with the images whose size changed.
+    void handleImageSizeChanged(const QString &p_imageName);
+
+    // Repaint the image area of blocks with the animated image.
+    void handleImageFrameChanged(const QString &p_imageName);
+
+    void updateCodeBlockIndex(int p_position, int p_charsRemoved, int p_charsAdded);
+
+    // Scroll by @p_dy to keep the contents still when blocks above the
+    // viewport changed their heights.
+    void anchorViewport(qreal p_dy);
+
 private:
     VTextDocumentLayout *getLayout() const;
 
     // Return the Y offset of the content via the scrollbar.
     int contentOffsetY() const;
 
+    // Update the line number of block @p_blockNumber.
+    void updateLineNumberRow(int p_blockNumber);
+
     VLineNumberArea *m_lineNumberArea;
 
     LineNumberType m_lineNumberType;
 
     VImageResourceManager2 *m_imageMgr;
 
+    // Code blocks for line numbers of LineNumberType::CodeBlock.
+    VCodeBlockIndex *m_codeBlockIndex;
+
     bool m_blockImageEnabled;
+
+    // Whether scrolling to keep the contents still in the viewport.
+    bool m_anchoringViewport;
+
+    // Fraction of the shifts of the layout not taken by the scroll bar yet.
+    qreal m_anchorRemainder;
+
+    // Block number of the cursor when the line numbers were last updated.
+    int m_cursorBlockNumber;
 };
 
 inline void VTextEdit::setLineNumberType(LineNumberType p_type)
@@ -0,0 +1,33 @@
+# Sources of VTextEdit shared by the demo and the benchmarks.
+
+INCLUDEPATH += $$PWD
+
+# Uncomment to compile the performance counters of the layout out.
+# DEFINES += VTEXTEDIT_NO_PERF_STATS
+
+# Uncomment to compile the trace spans out.
+# DEFINES += VTEXTEDIT_NO_TRACE
+
+SOURCES += \
+    $$PWD/vtextdocumentlayout.cpp \
+    $$PWD/vtextedit.cpp \
+    $$PWD/vlinenumberarea.cpp \
+    $$PWD/vimageresourcemanager2.cpp \
+    $$PWD/vimagestore.cpp \
+    $$PWD/vcodeblockindex.cpp \
+    $$PWD/vintervalindex.cpp \
+    $$PWD/vbulklayoutjob.cpp \
+    $$PWD/vtracer.cpp
+
+HEADERS += \
+    $$PWD/vtextdocumentlayout.h \
+    $$PWD/vtextedit.h \
+    $$PWD/vlinenumberarea.h \
+    $$PWD/vimageresourcemanager2.h \
+    $$PWD/vimagestore.h \
+    $$PWD/vcodeblockindex.h \
+    $$PWD/vblocktree.h \
+    $$PWD/vintervalindex.h \
+    $$PWD/vbulklayoutjob.h \
+    $$PWD/vlayoutstats.h \
+    $$PWD/vtracer.h
@@ -0,0 +1,120 @@
+#include "vtracer.h"
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QThread>
+
+
+// Default number of spans kept in the ring buffer.
+static const int c_defaultCapacity = 65536;
+
+
+VTracer &VTracer::instance()
+{
+    static VTracer tracer;
+    return tracer;
+}
+
+VTracer::VTracer()
+    : m_enabled(0),
+      m_next(0),
+      m_count(0)
+{
+    m_clock.start();
+    m_spans.resize(c_defaultCapacity);
+}
+
+void VTracer::setEnabled(bool p_enabled)
+{
+    m_enabled.storeRelease(p_enabled ? 1 : 0);
+}
+
+void VTracer::setCapacity(int p_capacity)
+{
+    if (p_capacity <= 0) {
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_spans.clear();
+    m_spans.resize(p_capacity);
+    m_next = 0;
+    m_count = 0;
+}
+
+void VTracer::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_next = 0;
+    m_count = 0;
+}
+
+void VTracer::record(const char *p_name, qint64 p_startNs, qint64 p_durationNs, int p_arg)
+{
+    quint64 threadId = (quint64)(quintptr)QThread::currentThreadId();
+
+    QMutexLocker locker(&m_mutex);
+    Span &span = m_spans[m_next];
+    span.m_name = p_name;
+    span.m_startNs = p_startNs;
+    span.m_durationNs = p_durationNs;
+    span.m_threadId = threadId;
+    span.m_arg = p_arg;
+
+    m_next = (m_next + 1) % m_spans.size();
+    if (m_count < m_spans.size()) {
+        ++m_count;
+    }
+}
+
+QByteArray VTracer::toChromeTrace() const
+{
+    const QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+
+    QByteArray json("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    QMutexLocker locker(&m_mutex);
+    // The oldest span first.
+    int idx = (m_next - m_count + m_spans.size()) % m_spans.size();
+    for (int i = 0; i < m_count; ++i) {
+        const Span &span = m_spans[idx];
+        if (i > 0) {
+            json += ',';
+        }
+
+        // Chrome trace uses microseconds.
+        json += "\n{\"name\":\"";
+        json += span.m_name;
+        json += "\",\"cat\":\"vtextedit\",\"ph\":\"X\",\"ts\":";
+        json += QByteArray::number(span.m_startNs / 1000.0, 'f', 3);
+        json += ",\"dur\":";
+        json += QByteArray::number(span.m_durationNs / 1000.0, 'f', 3);
+        json += ",\"pid\":";
+        json += pid;
+        json += ",\"tid\":";
+        json += QByteArray::number(span.m_threadId);
+        if (span.m_arg > -1) {
+            json += ",\"args\":{\"block\":";
+            json += QByteArray::number(span.m_arg);
+            json += '}';
+        }
+
+        json += '}';
+
+        idx = (idx + 1) % m_spans.size();
+    }
+
+    json += "\n]}\n";
+    return json;
+}
+
+bool VTracer::writeChromeTrace(const QString &p_filePath) const
+{
+    QFile file(p_filePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+
+    QByteArray json = toChromeTrace();
+    return file.write(json) == json.size();
+}
@@ -0,0 +1,130 @@
+#ifndef VTRACER_H
+#define VTRACER_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <QByteArray>
+#include <QString>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+
+
+// An opt-in process-wide tracer recording scoped spans into a ring buffer,
+// which could be dumped as Chrome trace_event JSON and loaded into a trace
+// viewer such as chrome://tracing.
+// Spans could be recorded from any thread.
+// Define VTEXTEDIT_NO_TRACE to compile all the spans out.
+class VTracer
+{
+public:
+    static VTracer &instance();
+
+    // Recording is disabled by default.
+    void setEnabled(bool p_enabled);
+
+    bool isEnabled() const;
+
+    // Set the maximum number of spans kept. Clear the recorded spans.
+    void setCapacity(int p_capacity);
+
+    void clear();
+
+    // Nanoseconds since the tracer is created.
+    qint64 now() const;
+
+    // Record a span.
+    // @p_name: must be a string literal.
+    // @p_arg: an optional argument such as the block number; -1 for none.
+    void record(const char *p_name, qint64 p_startNs, qint64 p_durationNs, int p_arg = -1);
+
+    // Return the recorded spans in Chrome trace_event JSON.
+    QByteArray toChromeTrace() const;
+
+    // Write toChromeTrace() to file @p_filePath.
+    bool writeChromeTrace(const QString &p_filePath) const;
+
+private:
+    struct Span
+    {
+        const char *m_name;
+
+        qint64 m_startNs;
+
+        qint64 m_durationNs;
+
+        quint64 m_threadId;
+
+        int m_arg;
+    };
+
+    VTracer();
+
+    QAtomicInt m_enabled;
+
+    QElapsedTimer m_clock;
+
+    mutable QMutex m_mutex;
+
+    // Ring buffer of spans.
+    QVector<Span> m_spans;
+
+    // Index in m_spans to write the next span.
+    int m_next;
+
+    // Number of valid spans in m_spans.
+    int m_count;
+};
+
+inline bool VTracer::isEnabled() const
+{
+    return m_enabled.loadAcquire() != 0;
+}
+
+inline qint64 VTracer::now() const
+{
+    return m_clock.nsecsElapsed();
+}
+
+
+// Record a span of current scope if the tracer is enabled.
+class VTraceSpan
+{
+public:
+    VTraceSpan(const char *p_name, int p_arg = -1)
+        : m_name(p_name),
+          m_arg(p_arg),
+          m_startNs(-1)
+    {
+        VTracer &tracer = VTracer::instance();
+        if (tracer.isEnabled()) {
+            m_startNs = tracer.now();
+        }
+    }
+
+    ~VTraceSpan()
+    {
+        if (m_startNs > -1) {
+            VTracer &tracer = VTracer::instance();
+            tracer.record(m_name, m_startNs, tracer.now() - m_startNs, m_arg);
+        }
+    }
+
+private:
+    const char *m_name;
+
+    int m_arg;
+
+    qint64 m_startNs;
+};
+
+
+#ifndef VTEXTEDIT_NO_TRACE
+#define V_TRACE_SPAN(p_name) VTraceSpan vTraceSpan((p_name))
+#define V_TRACE_SPAN_ARG(p_name, p_arg) VTraceSpan vTraceSpan((p_name), (p_arg))
+#else
+#define V_TRACE_SPAN(p_name)
+#define V_TRACE_SPAN_ARG(p_name, p_arg)
+#endif
+
+#endif // VTRACER_H